@@ -3,8 +3,14 @@
  * 
  * this program demonstrates thread synchronization using semaphores by printing
  * a paragraph where each thread is responsible for printing specific words.
+ *
+ * usage: paragraph_threads [options] [file | - ...]
+ * without an argument the built-in paragraph is printed, a file is mapped
+ * read-only and "-" reads the document from stdin. several documents are
+ * tokenized concurrently and printed one after another.
  */
 
+ #define _GNU_SOURCE
  #include <stdio.h>
  #include <stdlib.h>
  #include <pthread.h>
@@ -12,8 +18,75 @@
  #include <unistd.h>
  #include <string.h>
  #include <time.h>
+ #include <stdint.h>
+ #include <fcntl.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <stdatomic.h>
+ #include <sys/syscall.h>
+ #include <linux/futex.h>
+ #include <sched.h>
+ #include <dirent.h>
+ #include <sys/eventfd.h>
+ #include <poll.h>
+ #include <sys/uio.h>
+ #include <limits.h>
+ #include <errno.h>
+ #include <linux/io_uring.h>
  
- #define NUM_THREADS 5
+ #if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+ #define HAVE_X86_SIMD 1
+ #endif
+ 
+ #define DEFAULT_DELIMITERS " \t\n\v\f\r"
+ #define MAX_VECTOR_DELIMITERS 8       // delimiter sets the vector scanners handle
+ #define BENCH_HANDOFFS 200000         // turn handoffs timed per backend by -B handoff
+ #define DEFAULT_SPIN_LIMIT 4000       // most pause iterations a waiter spins before parking
+ #define MIN_SPIN_BUDGET 16            // spin budget never adapts below this
+ #define REORDER_SLOTS 1024            // words in flight in reorder mode, a power of two
+ #define DEFAULT_OUTPUT_BLOCK (64 << 10)  // bytes batched per writev when stdout is not a terminal
+ #define WRITER_BLOCK (1 << 20)        // bytes per write of the writer thread by default
+ #define URING_DEPTH 8                 // output batches in flight with -O uring
+ #define LINE_OVERHEAD 32              // bytes an output line takes beyond its word, at most
+ 
+ // per-thread sync objects and state are padded to this, build with
+ // -DCACHE_LINE_SIZE=128 where lines (or adjacent line prefetch) are wider
+ #ifndef CACHE_LINE_SIZE
+ #define CACHE_LINE_SIZE 64
+ #endif
+ #define TURN_SYNC_PADDED ((sizeof(turn_sync_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+ 
+ // how print_paragraph orders the output
+ enum {
+     MODE_NORMAL,         // threads take turns, printing in order
+     MODE_CHAOS,          // threads print as soon as they are ready
+     MODE_REORDER         // threads run freely, one emitter prints in order
+ };
+ 
+ // how printed lines reach stdout
+ enum {
+     OUTPUT_STDIO,        // a line per word through the stdout stream
+     OUTPUT_WRITEV,       // per-thread buffers, ordered segments batched into writev
+     OUTPUT_PWRITE,       // a block per thread, placed in the file with pwrite, no turns
+     OUTPUT_MMAP,         // the same blocks copied into the file mapped shared
+     OUTPUT_WRITER,       // the turn holder copies into double buffered blocks, a writer thread writes them
+     OUTPUT_URING,        // like writev, the batches queued to io_uring instead of written
+     OUTPUT_SPLICE,       // the turn holder copies into page-aligned blocks gifted to a pipe with vmsplice
+     OUTPUT_MODE_COUNT
+ };
+ 
+ // how printers take turns in normal mode
+ enum {
+     SYNC_SEMAPHORE,      // ring of semaphores, one per thread
+     SYNC_CONDVAR,        // ready flag per thread under a mutex, waited on with a condvar
+     SYNC_EVENTFD,        // eventfd per thread, waited on with poll
+     SYNC_FUTEX,          // shared word counter, owners parked on a futex
+     SYNC_SPIN,           // shared word counter, owners spin and yield
+     SYNC_BACKEND_COUNT
+ };
+ #define TOKENIZE_MIN_CHUNK (1 << 20)  // smallest slice worth its own tokenizer thread
+ #define INTERN_MIN_SYMBOLS 1024       // distinct words the intern table first makes room for
  
  // the paragraph to be printed
  const char *paragraph = "Computer science is the study of computation, automation, and information. "
@@ -21,234 +94,3459 @@
                         "Computer science is generally considered an area of academic research and "
                         "distinct from computer programming.";
  
- // thread data structure
+ // input document, the bytes are not nul-terminated
+ typedef struct {
+     const char *data;    // document bytes
+     size_t length;       // number of bytes in data
+     int is_mapped;       // data is a read-only mapping of the input file
+     int is_heap;         // data was read into a heap buffer
+ } input_t;
+ 
+ // a word is a span of the immutable paragraph buffer, not a copy of it
+ typedef struct {
+     size_t offset;       // byte offset of the word in the document
+     size_t length;       // length of the word in bytes
+ } word_span_t;
+ 
+ // growable array of word spans
+ typedef struct {
+     word_span_t *spans;
+     size_t count;        // number of spans in use
+     size_t capacity;     // number of spans allocated
+ } span_vec_t;
+ 
+ // bytes that separate words
+ typedef struct {
+     unsigned char is_delim[256];         // lookup table indexed by byte
+     char chars[MAX_VECTOR_DELIMITERS];   // the delimiters, for the vector scanners
+     int count;                           // number of distinct delimiters
+ } delimiter_set_t;
+ 
+ // tokenizer settings, shared read-only by concurrent tokenizations
+ typedef struct {
+     delimiter_set_t delims;
+     int threads;         // threads per document, 0 for one per cpu
+     int intern;          // store words as ids into a table of distinct words
+ } tokenizer_config_t;
+ 
+ // words of one document, self-contained so several can exist at once
+ typedef struct {
+     const char *text;    // document the spans point into, not owned
+     size_t length;       // length of the document
+     word_span_t *words;  // the words in document order, NULL when interned
+     size_t count;        // number of words
+     uint32_t *ids;       // symbol id of each word when interned
+     word_span_t *symbols;  // distinct words when interned, indexed by id
+     size_t symbol_count; // number of distinct words
+ } word_index_t;
+ 
+ /**
+  * returns word i of an index, resolving its symbol id when interned
+  */
+ static inline const word_span_t* index_word(const word_index_t *index, size_t i) {
+     return index->ids != NULL ? &index->symbols[index->ids[i]] : &index->words[i];
+ }
+ 
+ // a printer's sync objects for every turn backend, turn_sync_stride bytes
+ // apart: padded to whole lines so handing a turn to one thread does not
+ // steal the line its neighbour is waiting on, packed only in -B sharing
+ typedef struct {
+     sem_t sem;                // sem backend
+     pthread_mutex_t lock;     // condvar backend: guards ready
+     pthread_cond_t cond;
+     _Atomic int ready;        // condvar backend: the turn was passed to this thread
+     int efd;                  // eventfd backend
+     _Atomic uint32_t posted;  // eventfd backend: set before the write, so spinning needs no syscall
+     _Atomic uint32_t parked;  // futex word, 1 while this thread sleeps for its turn
+ } turn_sync_t;
+ 
+ // lines formatted by one thread, possibly still waiting in the output batch
+ // whole lines, the reorder emitter writes its own on every word
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) char *data;
+     size_t length;       // bytes in use, segments in flight end here
+     size_t capacity;
+     unsigned long generation;  // output batch the last segment was appended to
+ } output_arena_t;
+ 
+ // thread data structure, one cache line (or more) per thread
  typedef struct {
-     int thread_id;
-     char **words;        // array of words for this thread
-     int word_count;      // number of words assigned to this thread
-     sem_t *sem_wait;     // semaphore to wait on
-     sem_t *sem_signal;   // semaphore to signal
-     int is_chaos_mode;   // flag for chaos mode
+     _Alignas(CACHE_LINE_SIZE) int thread_id;
+     const word_index_t *index;  // document being printed
+     size_t first_turn;   // first turn of this thread, its position in the ring
+     size_t turn_count;   // number of turns this thread takes
+     size_t chunk_size;   // consecutive words printed per turn
+     int ring_size;       // threads taking turns
+     turn_sync_t *sync;   // this thread's sync objects
+     atomic_size_t *turn_counter;  // futex and spin backends: the shared turn counter
+     int spin_budget;     // pause iterations to spin before parking, self-tuning
+     unsigned long spin_hits;  // turns taken while spinning
+     unsigned long parks; // turns that had to sleep in the kernel
+     unsigned long yields;  // spin backend: sched_yield calls past the spin budget
+     int cpu;             // cpu this thread is pinned to, -1 when it floats
+     int last_cpu;        // cpu the previous turn ran on, -1 before the first
+     unsigned long migrations; // turns that ran on a different cpu than the one before
+     int mode;            // MODE_NORMAL, MODE_CHAOS or MODE_REORDER
+     output_arena_t out;  // -O writev: lines formatted by this thread
+     char prefix[24];     // "Thread <id + 1>: ", what every line of this thread starts with
+     size_t prefix_length;
+     size_t block_first;  // positional output: words block_first to block_last - 1
+     size_t block_last;
+     size_t block_bytes;  // positional output: formatted size of the block
+     off_t block_offset;  // positional output: where the block starts in the file
  } thread_data_t;
+
+ // the operations of a turn backend, selected with -s
+ typedef struct {
+     const char *name;
+     int sleeps;                                         // block parks the thread in the kernel
+     void (*arm)(void);                                  // hands turn 0 to printer 0
+     int (*try_take)(thread_data_t *data, size_t turn);  // nonzero once the turn is this thread's
+     void (*block)(thread_data_t *data, size_t turn);    // sleeps until it is
+     void (*pass)(thread_data_t *data, size_t turn);     // hands turn + 1 to the next thread
+ } sync_ops_t;
+ 
+ // one printer's flag and counter in the false sharing benchmark
+ typedef struct {
+     _Atomic uint32_t turn;    // last turn handed to this printer
+     unsigned long spins;      // bumped by the owner while it waits
+ } sharing_slot_t;
+ 
+ // work posted to the printer pool
+ typedef struct {
+     void *(*run)(void *);      // print_thread or handoff_thread, given the thread's data
+     const word_index_t *index; // document to print, NULL for the handoff benchmark
+     int mode;                  // MODE_NORMAL, MODE_CHAOS or MODE_REORDER
+     size_t chunk_size;         // consecutive words per turn
+     size_t turns;              // turns in the whole job
+     int active;                // printers in the ring, the first active of the pool
+ } print_job_t;
+ 
+ // printers that outlive a run, parked between jobs
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+     pthread_cond_t job_ready;  // a job was posted or the pool is stopping
+     pthread_cond_t job_done;   // the last printer of the job finished
+     print_job_t job;           // the current job
+     unsigned long generation;  // bumped for every job
+     int finished;              // printers done with the current job
+     int stop;                  // printers should exit
+ } printer_pool_t;
+ 
+ // where a cpu sits in the cache and memory hierarchy
+ typedef struct {
+     int cpu;
+     int node;            // numa node
+     int package;         // socket
+     int l3;              // id of the l3 cache it shares
+     int core;            // core, shared by smt siblings
+ } cpu_topology_t;
+ 
+ // ordered segments waiting for one writev, owned by the turn holder
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) struct iovec iov[IOV_MAX];
+     int count;
+     size_t bytes;
+     unsigned long flushed;             // batches handed off so far, the one being filled
+     _Atomic unsigned long generation;  // batches written so far
+ } output_batch_t;
+ 
+ // a batch in flight through io_uring, its iovecs point into the arenas
+ typedef struct {
+     struct iovec iov[IOV_MAX];
+     int count;
+     size_t bytes;
+     off_t offset;        // where it goes in a regular file
+     int done;            // completed, not yet retired
+ } uring_slot_t;
+ 
+ // the io_uring of -O uring, only ever touched by the turn holder
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) int fd;
+     void *sq_ring;
+     void *cq_ring;       // same as sq_ring when the kernel maps both at once
+     struct io_uring_sqe *sqes;
+     size_t sq_ring_size;
+     size_t cq_ring_size;
+     size_t sqes_size;
+     _Atomic unsigned *sq_tail;
+     unsigned sq_mask;
+     unsigned *sq_array;
+     _Atomic unsigned *cq_head;
+     _Atomic unsigned *cq_tail;
+     unsigned cq_mask;
+     struct io_uring_cqe *cqes;
+     int seekable;        // a regular file, written at explicit offsets
+     off_t offset;        // where the next batch goes in the file
+     unsigned long queued;     // batches put in the submission queue
+     unsigned long submitted;  // batches handed to the kernel
+     unsigned long drained;    // batches queued as of the last drain
+     uring_slot_t slots[URING_DEPTH];  // batch b uses slot and sqe b % URING_DEPTH
+ } output_uring_t;
+ 
+ // the two blocks of the writer thread
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) char *blocks[2];
+     size_t length[2];    // bytes in each block
+     size_t capacity;     // bytes each block holds
+     int fill;            // block the turn holder copies into
+     int pending;         // block handed to the writer, -1 when it is idle
+     int stop;            // the writer should exit once idle
+     unsigned long writes;  // blocks written
+     pthread_mutex_t lock;  // guards pending, stop and writes
+     pthread_cond_t cond;   // pending changed
+     pthread_t thread;
+ } output_writer_t;
+ 
+ // the block -O splice fills, gifted to the pipe when full
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) char *block;         // page-aligned, mapped afresh after every gift
+     size_t length;
+     size_t capacity;     // a whole number of pages
+     unsigned long gifts; // blocks handed to the pipe
+ } output_splice_t;
+ 
+ // a counter written on every handoff, alone on its line: aligning the
+ // variable alone would let the linker put other globals behind it
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) atomic_size_t value;
+     char pad[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+ } padded_counter_t;
+ 
+ // one word in flight through the reorder buffer, consecutive words are
+ // published by different threads so every slot gets a line of its own
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t seq;  // word index (mod 2^32) to store when free, plus one when full
+     _Atomic uint32_t waiters; // threads sleeping on seq
+     int thread_id;            // printer the word belongs to
+     const word_span_t *word;
+ } reorder_slot_t;
  
  // global variables
- sem_t semaphores[NUM_THREADS];
- char **all_words = NULL;
- int total_words = 0;
+ int num_threads = 0;             // printers taking part in a run
+ int pool_size = 0;               // printers started, at least num_threads
+ turn_sync_t *turn_syncs = NULL;  // one per printer thread, see turn_sync()
+ size_t turn_sync_stride = 0;     // bytes from one printer's sync objects to the next
+ pthread_t *printer_threads = NULL;
+ thread_data_t *printer_data = NULL;
+ reorder_slot_t *reorder_slots = NULL;  // bounded ring keyed by word index
+ printer_pool_t pool;
+ output_batch_t out_batch;
+ output_arena_t emitter_out;      // -O writev: lines of the reorder mode emitter
+ output_writer_t writer;          // -O writer
+ output_uring_t uring;            // -O uring
+ output_splice_t gift;            // -O splice
+ char *output_map = NULL;         // -O mmap: the output file while a document is placed
+ off_t output_map_start = 0;      // file offset output_map starts at
+ int sync_backend = SYNC_SEMAPHORE;
+ padded_counter_t next_turn;      // futex and spin backends: the turn in progress
+ atomic_size_t *turn_counter = &next_turn.value;  // where printers find it, moved by -B sharing
+ int spin_limit = -1;             // upper bound of the spin budget, -1 until chosen
+ int verbose = 0;                 // report handoff statistics on stderr
+ int benchmark_mode = 0;          // no artificial delays, report throughput on stderr
+ size_t chunk_size = 1;           // consecutive words printed per turn
+ int output_mode = OUTPUT_STDIO;
+ size_t output_block = DEFAULT_OUTPUT_BLOCK;  // bytes gathered per write, 0 writes every turn
+ int *pin_cpus = NULL;            // cpus printers are pinned to, round robin
+ int pin_cpu_count = 0;           // 0 leaves the printers to the scheduler
+ char *sharing_slots = NULL;      // false sharing benchmark: sharing_slot_t every sharing_stride bytes
+ size_t sharing_stride = 0;
+ 
+ const char *mode_names[] = {"normal", "chaos", "reorder"};
+ const char *output_names[OUTPUT_MODE_COUNT] = {"stdio", "writev", "pwrite", "mmap", "writer", "uring", "splice"};
  
  /**
-  * splits the paragraph into words
-  * returns the total number of words
+  * reads a stream that cannot be mapped (stdin, pipes) into a heap buffer
   */
- int split_paragraph_into_words() {
-     // count the spaces to determine number of words
-     int spaces = 0;
-     for (int i = 0; paragraph[i] != '\0'; i++) {
-         if (paragraph[i] == ' ') {
-             spaces++;
+ void read_stream_input(int fd, input_t *input) {
+     size_t capacity = 1 << 16;
+     size_t length = 0;
+     char *buffer = (char*)malloc(capacity);
+     if (buffer == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     for (;;) {
+         // grow geometrically so large streams are copied a bounded number of times
+         if (length == capacity) {
+             capacity *= 2;
+             char *grown = (char*)realloc(buffer, capacity);
+             if (grown == NULL) {
+                 perror("realloc failed");
+                 free(buffer);
+                 exit(EXIT_FAILURE);
+             }
+             buffer = grown;
+         }
+         
+         ssize_t n = read(fd, buffer + length, capacity - length);
+         if (n < 0) {
+             perror("read failed");
+             free(buffer);
+             exit(EXIT_FAILURE);
          }
+         if (n == 0) {
+             break;
+         }
+         length += (size_t)n;
      }
      
-     // total words = spaces + 1
-     total_words = spaces + 1;
+     input->data = buffer;
+     input->length = length;
+     input->is_heap = 1;
+ }
+ 
+ /**
+  * opens the document to print
+  * path: NULL for the built-in paragraph, "-" for stdin, otherwise a file
+  * regular files are mapped read-only so the tokenizer works on them in place
+  */
+ void open_input(const char *path, input_t *input) {
+     memset(input, 0, sizeof(*input));
      
-     // allocate memory for array of word pointers
-     all_words = (char**)malloc(total_words * sizeof(char*));
-     if (all_words == NULL) {
-         perror("malloc failed");
-         exit(EXIT_FAILURE);
+     if (path == NULL) {
+         input->data = paragraph;
+         input->length = strlen(paragraph);
+         return;
      }
      
-     // create a copy of the paragraph to tokenize
-     char *paragraph_copy = strdup(paragraph);
-     if (paragraph_copy == NULL) {
-         perror("strdup failed");
-         free(all_words);
-         exit(EXIT_FAILURE);
+     int fd = STDIN_FILENO;
+     if (strcmp(path, "-") != 0) {
+         fd = open(path, O_RDONLY);
+         if (fd < 0) {
+             perror(path);
+             exit(EXIT_FAILURE);
+         }
      }
      
-     // tokenize the paragraph and store each word
-     char *token = strtok(paragraph_copy, " ");
-     int word_idx = 0;
+     struct stat st;
+     if (fstat(fd, &st) != 0) {
+         perror("fstat failed");
+         exit(EXIT_FAILURE);
+     }
      
-     while (token != NULL && word_idx < total_words) {
-         all_words[word_idx] = strdup(token);
-         if (all_words[word_idx] == NULL) {
-             perror("strdup failed");
-             // cleanup already allocated memory
-             for (int i = 0; i < word_idx; i++) {
-                 free(all_words[i]);
-             }
-             free(all_words);
-             free(paragraph_copy);
+     if (S_ISREG(st.st_mode) && st.st_size > 0) {
+         void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (map == MAP_FAILED) {
+             perror("mmap failed");
              exit(EXIT_FAILURE);
          }
-         word_idx++;
-         token = strtok(NULL, " ");
+         // the tokenizer and printers both walk the document front to back
+         madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+         input->data = (const char*)map;
+         input->length = (size_t)st.st_size;
+         input->is_mapped = 1;
+     } else {
+         // stdin, pipes and files without a size fall back to a streaming read
+         read_stream_input(fd, input);
      }
      
-     free(paragraph_copy);
-     return total_words;
+     if (fd != STDIN_FILENO) {
+         close(fd);
+     }
  }
  
  /**
-  * frees the memory allocated for words
+  * releases the document opened by open_input
   */
- void free_words() {
-     if (all_words != NULL) {
-         for (int i = 0; i < total_words; i++) {
-             free(all_words[i]);
+ void close_input(input_t *input) {
+     if (input->is_mapped) {
+         munmap((void*)input->data, input->length);
+     } else if (input->is_heap) {
+         free((void*)input->data);
+     }
+     memset(input, 0, sizeof(*input));
+ }
+ 
+ /**
+  * builds a delimiter set from the characters of chars
+  */
+ void init_delimiters(delimiter_set_t *set, const char *chars) {
+     memset(set, 0, sizeof(*set));
+     for (const unsigned char *c = (const unsigned char *)chars; *c != '\0'; c++) {
+         if (set->is_delim[*c]) {
+             continue;
+         }
+         set->is_delim[*c] = 1;
+         if (set->count < MAX_VECTOR_DELIMITERS) {
+             set->chars[set->count] = (char)*c;
          }
-         free(all_words);
-         all_words = NULL;
+         set->count++;
      }
  }
  
  /**
-  * thread function that prints assigned words
-  * waits on its semaphore, prints its part, and signals the next thread
+  * appends a word to a span vector, growing it geometrically
   */
- void* print_thread(void *arg) {
-     thread_data_t *data = (thread_data_t *)arg;
-     
-     // loop through all words assigned to this thread
-     for (int i = 0; i < data->word_count; i++) {
-         if (!data->is_chaos_mode) {
-             // normal mode - use semaphores for synchronization
-             sem_wait(data->sem_wait);
+ static inline void span_vec_push(span_vec_t *vec, size_t offset, size_t length) {
+     if (vec->count == vec->capacity) {
+         size_t capacity = vec->capacity ? vec->capacity * 2 : 1024;
+         word_span_t *grown = (word_span_t*)realloc(vec->spans, capacity * sizeof(word_span_t));
+         if (grown == NULL) {
+             perror("realloc failed");
+             exit(EXIT_FAILURE);
          }
-         
-         // add random delay (10-100ms)
-         usleep((rand() % 91 + 10) * 1000);
-         
-         // print the word and add a newline after every thread's print
-         printf("Thread %d: %s\n", data->thread_id + 1, data->words[i]);
-         
-         if (!data->is_chaos_mode) {
-             // normal mode - signal the next thread
-             sem_post(data->sem_signal);
-             
-             // wait for a short time to ensure proper order
-             usleep(1000);
+         vec->spans = grown;
+         vec->capacity = capacity;
+     }
+     vec->spans[vec->count].offset = offset;
+     vec->spans[vec->count].length = length;
+     vec->count++;
+ }
+ 
+ /*
+  * word scanners
+  * a scanner walks text[begin, end) once and appends every word to out as
+  * a span. a word belongs to the range its first byte lies in, so a word
+  * cut by begin is left to the previous range and a word cut by end is
+  * followed to its real end. any byte in the delimiter set separates words
+  * and runs of delimiters never produce empty words. the vector versions
+  * classify 16 or 32 bytes at a time into a delimiter bitmask and only
+  * visit the bytes where a word starts or ends.
+  */
+ typedef void (*word_scanner_fn)(const char *text, size_t length, size_t begin, size_t end,
+                                 const delimiter_set_t *delims, span_vec_t *out);
+ 
+ // state carried across the blocks of a scan
+ typedef struct {
+     int in_word;         // the previous byte belonged to a word
+     size_t word_start;   // offset of the word being scanned
+ } scan_state_t;
+ 
+ #define IS_DELIM(delims, c) ((delims)->is_delim[(unsigned char)(c)])
+ 
+ /**
+  * scans text[pos, end) one byte at a time
+  */
+ static inline void scan_bytes(scan_state_t *st, const char *text, size_t pos, size_t end,
+                               const delimiter_set_t *delims, span_vec_t *out) {
+     for (; pos < end; pos++) {
+         int is_delim = IS_DELIM(delims, text[pos]);
+         if (st->in_word && is_delim) {
+             span_vec_push(out, st->word_start, pos - st->word_start);
+             st->in_word = 0;
+         } else if (!st->in_word && !is_delim) {
+             st->word_start = pos;
+             st->in_word = 1;
+         }
+     }
+ }
+ 
+ /**
+  * handles one block of a vector scan
+  * bit j of mask is set when byte pos + j is a delimiter
+  */
+ static inline void scan_mask(scan_state_t *st, uint64_t mask, int width, size_t pos,
+                              span_vec_t *out) {
+     uint64_t block = (width == 64) ? ~0ULL : ((1ULL << width) - 1);
+     
+     // a bit flips wherever the byte differs in kind from the one before it
+     uint64_t prev = (mask << 1) | (st->in_word ? 0 : 1);
+     uint64_t edges = (mask ^ prev) & block;
+     
+     while (edges != 0) {
+         int j = __builtin_ctzll(edges);
+         if (mask & (1ULL << j)) {
+             span_vec_push(out, st->word_start, pos + j - st->word_start);
+         } else {
+             st->word_start = pos + j;
          }
+         edges &= edges - 1;
      }
      
-     return NULL;
+     st->in_word = !((mask >> (width - 1)) & 1);
  }
  
  /**
-  * initializes semaphores
+  * returns where a scan of text[begin, end) starts
+  * skips the tail of a word that started before begin
   */
- void init_semaphores() {
-     for (int i = 0; i < NUM_THREADS; i++) {
-         // initialize all semaphores to 0 except the first one
-         if (sem_init(&semaphores[i], 0, (i == 0) ? 1 : 0) != 0) {
-             perror("sem_init failed");
-             exit(EXIT_FAILURE);
+ static inline size_t scan_begin(const char *text, size_t begin, size_t end,
+                                 const delimiter_set_t *delims) {
+     if (begin > 0 && !IS_DELIM(delims, text[begin - 1])) {
+         while (begin < end && !IS_DELIM(delims, text[begin])) {
+             begin++;
          }
      }
+     return begin;
  }
  
  /**
-  * destroys semaphores
+  * finishes a scan ending at end, following an open word past end
   */
- void destroy_semaphores() {
-     for (int i = 0; i < NUM_THREADS; i++) {
-         sem_destroy(&semaphores[i]);
+ static inline void scan_finish(scan_state_t *st, const char *text, size_t length, size_t end,
+                                const delimiter_set_t *delims, span_vec_t *out) {
+     if (st->in_word) {
+         while (end < length && !IS_DELIM(delims, text[end])) {
+             end++;
+         }
+         span_vec_push(out, st->word_start, end - st->word_start);
+         st->in_word = 0;
      }
  }
  
  /**
-  * resets semaphores for a new run
+  * portable scanner, one byte at a time
   */
- void reset_semaphores() {
-     // first destroy existing semaphores
-     destroy_semaphores();
-     // then initialize them again
-     init_semaphores();
+ void scan_words_scalar(const char *text, size_t length, size_t begin, size_t end,
+                        const delimiter_set_t *delims, span_vec_t *out) {
+     scan_state_t st = {0, 0};
+     scan_bytes(&st, text, scan_begin(text, begin, end, delims), end, delims, out);
+     scan_finish(&st, text, length, end, delims, out);
  }
  
+ #ifdef HAVE_X86_SIMD
  /**
-  * prints paragraph using multiple threads
-  * mode: 0 for normal mode, 1 for chaos mode
+  * sse2 scanner, 16 bytes per step
   */
- void print_paragraph(int mode) {
-     pthread_t threads[NUM_THREADS];
-     thread_data_t thread_data[NUM_THREADS];
+ __attribute__((target("sse2")))
+ void scan_words_sse2(const char *text, size_t length, size_t begin, size_t end,
+                      const delimiter_set_t *delims, span_vec_t *out) {
+     scan_state_t st = {0, 0};
+     __m128i delim[MAX_VECTOR_DELIMITERS];
+     for (int i = 0; i < delims->count; i++) {
+         delim[i] = _mm_set1_epi8(delims->chars[i]);
+     }
+     size_t pos = scan_begin(text, begin, end, delims);
      
-     // initialize thread data and create threads
-     for (int i = 0; i < NUM_THREADS; i++) {
-         thread_data[i].thread_id = i;
-         
-         // count how many words this thread will process
-         int count = 0;
-         for (int j = i; j < total_words; j += NUM_THREADS) {
-             count++;
+     for (; pos + 16 <= end; pos += 16) {
+         __m128i chunk = _mm_loadu_si128((const __m128i*)(text + pos));
+         __m128i hits = _mm_cmpeq_epi8(chunk, delim[0]);
+         for (int i = 1; i < delims->count; i++) {
+             hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, delim[i]));
          }
-         
-         thread_data[i].word_count = count;
-         
-         // allocate memory for words
-         thread_data[i].words = (char**)malloc(count * sizeof(char*));
-         if (thread_data[i].words == NULL) {
-             perror("malloc failed");
-             exit(EXIT_FAILURE);
+         scan_mask(&st, (uint32_t)_mm_movemask_epi8(hits), 16, pos, out);
+     }
+     
+     scan_bytes(&st, text, pos, end, delims, out);
+     scan_finish(&st, text, length, end, delims, out);
+ }
+ 
+ /**
+  * avx2 scanner, 32 bytes per step
+  */
+ __attribute__((target("avx2")))
+ void scan_words_avx2(const char *text, size_t length, size_t begin, size_t end,
+                      const delimiter_set_t *delims, span_vec_t *out) {
+     scan_state_t st = {0, 0};
+     __m256i delim[MAX_VECTOR_DELIMITERS];
+     for (int i = 0; i < delims->count; i++) {
+         delim[i] = _mm256_set1_epi8(delims->chars[i]);
+     }
+     size_t pos = scan_begin(text, begin, end, delims);
+     
+     for (; pos + 32 <= end; pos += 32) {
+         __m256i chunk = _mm256_loadu_si256((const __m256i*)(text + pos));
+         __m256i hits = _mm256_cmpeq_epi8(chunk, delim[0]);
+         for (int i = 1; i < delims->count; i++) {
+             hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, delim[i]));
          }
-         
-         // assign words to this thread in sequential order
-         int word_pos = 0;
-         for (int j = i; j < total_words; j += NUM_THREADS) {
-             thread_data[i].words[word_pos++] = all_words[j];
+         scan_mask(&st, (uint32_t)_mm256_movemask_epi8(hits), 32, pos, out);
+     }
+     
+     scan_bytes(&st, text, pos, end, delims, out);
+     scan_finish(&st, text, length, end, delims, out);
+ }
+ #endif
+ 
+ /**
+  * picks the widest scanner the running cpu supports for a delimiter set
+  */
+ word_scanner_fn select_word_scanner(const delimiter_set_t *delims) {
+ #ifdef HAVE_X86_SIMD
+     // the vector scanners compare against each delimiter in turn
+     if (delims->count >= 1 && delims->count <= MAX_VECTOR_DELIMITERS) {
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) {
+             return scan_words_avx2;
          }
+         if (__builtin_cpu_supports("sse2")) {
+             return scan_words_sse2;
+         }
+     }
+ #else
+     (void)delims;
+ #endif
+     return scan_words_scalar;
+ }
+ 
+ // slice of the document tokenized by one thread
+ typedef struct {
+     const char *text;    // whole document
+     size_t length;       // length of the whole document
+     size_t begin;        // first byte of this slice
+     size_t end;          // one past the last byte of this slice
+     word_scanner_fn scan;
+     const delimiter_set_t *delims;
+     span_vec_t words;    // words starting in this slice
+ } tokenize_chunk_t;
+ 
+ /**
+  * thread function that tokenizes one slice of the document
+  */
+ void* tokenize_chunk_thread(void *arg) {
+     tokenize_chunk_t *chunk = (tokenize_chunk_t *)arg;
+     chunk->scan(chunk->text, chunk->length, chunk->begin, chunk->end, chunk->delims, &chunk->words);
+     return NULL;
+ }
+ 
+ /**
+  * returns how many threads should tokenize a document of the given length
+  */
+ int tokenizer_thread_count(size_t length, int configured) {
+     long threads = configured;
+     if (threads <= 0) {
+         threads = sysconf(_SC_NPROCESSORS_ONLN);
+     }
+     
+     // small documents are not worth the thread startup
+     long max_chunks = (long)(length / TOKENIZE_MIN_CHUNK);
+     if (threads > max_chunks) {
+         threads = max_chunks;
+     }
+     return threads < 1 ? 1 : (int)threads;
+ }
+ 
+ /**
+  * tokenizes the document in parallel slices and stitches the results
+  * into index, placing each slice at the prefix sum of the counts of the
+  * slices before it
+  */
+ void split_in_chunks(const char *text, size_t length, word_scanner_fn scan,
+                      const delimiter_set_t *delims, int nchunks, word_index_t *index) {
+     pthread_t *threads = (pthread_t*)malloc(nchunks * sizeof(pthread_t));
+     tokenize_chunk_t *chunks = (tokenize_chunk_t*)calloc(nchunks, sizeof(tokenize_chunk_t));
+     if (threads == NULL || chunks == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     for (int i = 0; i < nchunks; i++) {
+         chunks[i].text = text;
+         chunks[i].length = length;
+         chunks[i].begin = length / nchunks * i;
+         chunks[i].end = (i == nchunks - 1) ? length : length / nchunks * (i + 1);
+         chunks[i].scan = scan;
+         chunks[i].delims = delims;
          
-         // set semaphores for synchronization
-         thread_data[i].sem_wait = &semaphores[i];
-         thread_data[i].sem_signal = &semaphores[(i + 1) % NUM_THREADS];
-         thread_data[i].is_chaos_mode = mode;
-         
-         // create thread
-         if (pthread_create(&threads[i], NULL, print_thread, (void*)&thread_data[i]) != 0) {
+         // the calling thread takes the first slice itself
+         if (i > 0 && pthread_create(&threads[i], NULL, tokenize_chunk_thread, &chunks[i]) != 0) {
              perror("pthread_create failed");
              exit(EXIT_FAILURE);
          }
      }
+     tokenize_chunk_thread(&chunks[0]);
      
-     // wait for all threads to complete
-     for (int i = 0; i < NUM_THREADS; i++) {
+     index->count = chunks[0].words.count;
+     for (int i = 1; i < nchunks; i++) {
          pthread_join(threads[i], NULL);
+         index->count += chunks[i].words.count;
+     }
+     
+     index->words = (word_span_t*)malloc((index->count ? index->count : 1) * sizeof(word_span_t));
+     if (index->words == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     size_t first = 0;
+     for (int i = 0; i < nchunks; i++) {
+         memcpy(index->words + first, chunks[i].words.spans, chunks[i].words.count * sizeof(word_span_t));
+         first += chunks[i].words.count;
+         free(chunks[i].words.spans);
+     }
+     
+     free(chunks);
+     free(threads);
+ }
+ 
+ /**
+  * tokenizes the whole document on the calling thread
+  */
+ void split_in_one_pass(const char *text, size_t length, word_scanner_fn scan,
+                        const delimiter_set_t *delims, word_index_t *index) {
+     span_vec_t words = {NULL, 0, 0};
+     scan(text, length, 0, length, delims, &words);
+     
+     // give back the slack left by the last growth step
+     if (words.count > 0 && words.count < words.capacity) {
+         word_span_t *shrunk = (word_span_t*)realloc(words.spans, words.count * sizeof(word_span_t));
+         if (shrunk != NULL) {
+             words.spans = shrunk;
+         }
+     }
+     
+     index->words = words.spans;
+     index->count = words.count;
+ }
+ 
+ // shared state of one interning run
+ typedef struct {
+     const char *text;          // document the words point into
+     const word_span_t *words;  // words to intern, in document order
+     uint32_t *ids;             // symbol id of each word, filled in
+     word_span_t *symbols;      // first occurrence of each distinct word
+     size_t capacity;           // symbols allocated, the table grows when they run out
+     atomic_uint_least32_t next_id;  // next free symbol id
+     _Atomic uint32_t *slots;   // open addressing table of symbol id + 1, 0 when empty
+     size_t mask;               // number of slots minus one
+ } intern_table_t;
+ 
+ // range of words interned by one thread
+ typedef struct {
+     intern_table_t *table;
+     size_t begin;              // next word to intern, kept when the table fills up
+     size_t end;
+ } intern_chunk_t;
+ 
+ /**
+  * fnv-1a hash of a word
+  */
+ static inline uint64_t hash_word(const char *word, size_t length) {
+     uint64_t hash = 14695981039346656037ULL;
+     for (size_t i = 0; i < length; i++) {
+         hash ^= (unsigned char)word[i];
+         hash *= 1099511628211ULL;
+     }
+     return hash;
+ }
+ 
+ /**
+  * returns the symbol id of a word, adding it to the table if it is new
+  * lock-free: a new symbol is published by a compare-and-swap on an empty
+  * slot. when two threads race to add the same word, the loser finds the
+  * winner's symbol on retry and its own id is left unused. returns
+  * UINT32_MAX when a new word finds no symbol left, before publishing it.
+  */
+ uint32_t intern_word(intern_table_t *table, const word_span_t *word) {
+     const char *chars = table->text + word->offset;
+     size_t slot = hash_word(chars, word->length) & table->mask;
+     uint32_t own_id = UINT32_MAX;
+     
+     for (;;) {
+         uint32_t entry = atomic_load_explicit(&table->slots[slot], memory_order_acquire);
+         
+         if (entry == 0) {
+             // claim an id and fill in the symbol before publishing it
+             if (own_id == UINT32_MAX) {
+                 own_id = atomic_fetch_add_explicit(&table->next_id, 1, memory_order_relaxed);
+                 if (own_id >= table->capacity) {
+                     return UINT32_MAX;
+                 }
+                 table->symbols[own_id] = *word;
+             }
+             if (atomic_compare_exchange_strong_explicit(&table->slots[slot], &entry, own_id + 1,
+                                                         memory_order_release, memory_order_acquire)) {
+                 return own_id;
+             }
+             // lost the slot, entry now holds the winner
+         }
          
-         // free allocated memory for words
-         free(thread_data[i].words);
+         const word_span_t *symbol = &table->symbols[entry - 1];
+         if (symbol->length == word->length &&
+             memcmp(table->text + symbol->offset, chars, word->length) == 0) {
+             return entry - 1;
+         }
+         slot = (slot + 1) & table->mask;
      }
  }
  
- int main() {
-     // seed the random number generator
-     srand(time(NULL));
+ /**
+  * thread function that interns one range of words
+  * stops early when the symbols run out, leaving begin at the word to resume from
+  */
+ void* intern_chunk_thread(void *arg) {
+     intern_chunk_t *chunk = (intern_chunk_t *)arg;
+     intern_table_t *table = chunk->table;
      
-     // split the paragraph into words
-     split_paragraph_into_words();
+     for (; chunk->begin < chunk->end; chunk->begin++) {
+         uint32_t id = intern_word(table, &table->words[chunk->begin]);
+         if (id == UINT32_MAX) {
+             break;
+         }
+         table->ids[chunk->begin] = id;
+     }
      
-     // initialize semaphores
-     init_semaphores();
+     return NULL;
+ }
+
+ /**
+  * doubles the symbols of an intern table, capped at one per word, and
+  * rehashes the published symbols into a slot table twice their number.
+  * only called while no intern thread runs.
+  */
+ void grow_intern_table(intern_table_t *table, size_t count) {
+     // ids claimed past the end were never published
+     if (atomic_load(&table->next_id) > table->capacity) {
+         atomic_store(&table->next_id, (uint32_t)table->capacity);
+     }
      
-     // print in normal mode
-     printf("\n=== Normal Mode (With Semaphore Synchronization) ===\n");
-     print_paragraph(0);
+     size_t capacity = table->capacity * 2 < count ? table->capacity * 2 : count;
+     word_span_t *symbols = (word_span_t*)realloc(table->symbols, capacity * sizeof(word_span_t));
+     size_t nslots = (table->mask + 1) * 2;
+     while (nslots < capacity * 2) {
+         nslots *= 2;
+     }
+     _Atomic uint32_t *slots = (_Atomic uint32_t*)calloc(nslots, sizeof(uint32_t));
+     if (symbols == NULL || slots == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
      
-     // reset semaphores for chaos mode
-     reset_semaphores();
+     // ids left unused by a lost race are in no slot and stay unused
+     for (size_t i = 0; i <= table->mask; i++) {
+         uint32_t entry = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+         if (entry != 0) {
+             const word_span_t *symbol = &symbols[entry - 1];
+             size_t slot = hash_word(table->text + symbol->offset, symbol->length) & (nslots - 1);
+             while (atomic_load_explicit(&slots[slot], memory_order_relaxed) != 0) {
+                 slot = (slot + 1) & (nslots - 1);
+             }
+             atomic_store_explicit(&slots[slot], entry, memory_order_relaxed);
+         }
+     }
      
-     // wait a moment to visually separate the outputs
-     sleep(1);
+     free((void*)table->slots);
+     table->symbols = symbols;
+     table->capacity = capacity;
+     table->slots = slots;
+     table->mask = nslots - 1;
+ }
+ 
+ /**
+  * replaces the spans of an index with 32-bit symbol ids
+  * each distinct word is stored once in index->symbols and the word stream
+  * becomes index->ids. the hash table only lives while interning, so the
+  * finished index costs 4 bytes per word plus one span per distinct word.
+  * the table starts small and grows with the distinct words found: the
+  * threads stop when the symbols run out, the table doubles and they
+  * resume where they stopped, so a repetitive document never pays for
+  * symbols or slots sized by its word count.
+  */
+ void intern_word_index(word_index_t *index, int nthreads) {
+     // ids are 32 bits wide, larger documents keep their spans
+     if (index->count == 0 || index->count >= UINT32_MAX) {
+         return;
+     }
      
-     // print in chaos mode
-     printf("\n=== Chaos Mode (Without Semaphore Synchronization) ===\n");
-     print_paragraph(1);
+     // keep the table at most half full
+     size_t capacity = index->count < INTERN_MIN_SYMBOLS ? index->count : INTERN_MIN_SYMBOLS;
+     size_t nslots = 16;
+     while (nslots < capacity * 2) {
+         nslots *= 2;
+     }
      
-     // cleanup
-     destroy_semaphores();
-     free_words();
+     intern_table_t table;
+     table.text = index->text;
+     table.words = index->words;
+     table.ids = (uint32_t*)malloc(index->count * sizeof(uint32_t));
+     table.symbols = (word_span_t*)malloc(capacity * sizeof(word_span_t));
+     table.capacity = capacity;
+     table.slots = (_Atomic uint32_t*)calloc(nslots, sizeof(uint32_t));
+     if (table.ids == NULL || table.symbols == NULL || table.slots == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     atomic_init(&table.next_id, 0);
+     table.mask = nslots - 1;
+     
+     pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+     intern_chunk_t *chunks = (intern_chunk_t*)malloc(nthreads * sizeof(intern_chunk_t));
+     if (threads == NULL || chunks == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     for (int i = 0; i < nthreads; i++) {
+         chunks[i].table = &table;
+         chunks[i].begin = index->count / nthreads * i;
+         chunks[i].end = (i == nthreads - 1) ? index->count : index->count / nthreads * (i + 1);
+     }
+     
+     for (;;) {
+         // the calling thread takes the first range itself
+         for (int i = 1; i < nthreads; i++) {
+             if (pthread_create(&threads[i], NULL, intern_chunk_thread, &chunks[i]) != 0) {
+                 perror("pthread_create failed");
+                 exit(EXIT_FAILURE);
+             }
+         }
+         intern_chunk_thread(&chunks[0]);
+         
+         int done = chunks[0].begin == chunks[0].end;
+         for (int i = 1; i < nthreads; i++) {
+             pthread_join(threads[i], NULL);
+             done &= chunks[i].begin == chunks[i].end;
+         }
+         if (done) {
+             break;
+         }
+         grow_intern_table(&table, index->count);
+     }
+     
+     free(chunks);
+     free(threads);
+     free((void*)table.slots);
+     free(index->words);
+     
+     index->symbol_count = atomic_load(&table.next_id);
+     word_span_t *shrunk = (word_span_t*)realloc(table.symbols, index->symbol_count * sizeof(word_span_t));
+     index->symbols = (shrunk != NULL) ? shrunk : table.symbols;
+     index->ids = table.ids;
+     index->words = NULL;
+ }
+ 
+ /**
+  * splits a document into words
+  * reentrant: all state lives in the returned index, which the caller
+  * releases with free_word_index. the text must outlive the index.
+  */
+ word_index_t* tokenize_document(const char *text, size_t length, const tokenizer_config_t *config) {
+     word_index_t *index = (word_index_t*)calloc(1, sizeof(word_index_t));
+     if (index == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     index->text = text;
+     index->length = length;
+     
+     word_scanner_fn scan = select_word_scanner(&config->delims);
+     
+     int nchunks = tokenizer_thread_count(length, config->threads);
+     if (nchunks > 1) {
+         split_in_chunks(text, length, scan, &config->delims, nchunks, index);
+     } else {
+         split_in_one_pass(text, length, scan, &config->delims, index);
+     }
+     
+     if (config->intern) {
+         intern_word_index(index, nchunks);
+     }
+     return index;
+ }
+ 
+ /**
+  * frees a word index
+  */
+ void free_word_index(word_index_t *index) {
+     if (index != NULL) {
+         // the spans point into the document, so only the arrays are owned
+         free(index->words);
+         free(index->ids);
+         free(index->symbols);
+         free(index);
+     }
+ }
+ 
+ // queue of documents tokenized by a pool of threads
+ typedef struct {
+     const input_t *inputs;
+     word_index_t **indexes;   // result slot for each document
+     size_t count;             // number of documents
+     atomic_size_t next;       // next document to take
+     const tokenizer_config_t *config;
+ } tokenize_queue_t;
+ 
+ /**
+  * thread function that tokenizes documents until the queue is empty
+  */
+ void* tokenize_queue_thread(void *arg) {
+     tokenize_queue_t *queue = (tokenize_queue_t *)arg;
+     
+     for (;;) {
+         size_t i = atomic_fetch_add(&queue->next, 1);
+         if (i >= queue->count) {
+             break;
+         }
+         queue->indexes[i] = tokenize_document(queue->inputs[i].data, queue->inputs[i].length,
+                                               queue->config);
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * tokenizes several documents concurrently, one job per cpu
+  * returns an array with one word index per input
+  */
+ word_index_t** tokenize_documents(const input_t *inputs, size_t count, const tokenizer_config_t *config) {
+     word_index_t **indexes = (word_index_t**)calloc(count ? count : 1, sizeof(word_index_t*));
+     if (indexes == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     // a single document is split across the cpus by tokenize_document itself
+     if (count == 1) {
+         indexes[0] = tokenize_document(inputs[0].data, inputs[0].length, config);
+         return indexes;
+     }
+     
+     // with several documents each job tokenizes a whole document on one cpu
+     tokenizer_config_t job_config = *config;
+     job_config.threads = 1;
+     
+     tokenize_queue_t queue;
+     queue.inputs = inputs;
+     queue.indexes = indexes;
+     queue.count = count;
+     atomic_init(&queue.next, 0);
+     queue.config = &job_config;
+     
+     long nthreads = config->threads > 0 ? config->threads : sysconf(_SC_NPROCESSORS_ONLN);
+     if (nthreads > (long)count) {
+         nthreads = (long)count;
+     }
+     if (nthreads < 1) {
+         nthreads = 1;
+     }
+     
+     pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+     if (threads == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     // the calling thread works the queue alongside the helpers
+     for (long i = 1; i < nthreads; i++) {
+         if (pthread_create(&threads[i], NULL, tokenize_queue_thread, &queue) != 0) {
+             perror("pthread_create failed");
+             exit(EXIT_FAILURE);
+         }
+     }
+     tokenize_queue_thread(&queue);
+     for (long i = 1; i < nthreads; i++) {
+         pthread_join(threads[i], NULL);
+     }
+     
+     free(threads);
+     return indexes;
+ }
+ 
+ /**
+  * returns the current monotonic time in nanoseconds
+  */
+ static inline uint64_t now_ns() {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+ 
+ static inline void futex_wait(_Atomic uint32_t *addr, uint32_t expected) {
+     syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+ }
+ 
+ static inline void futex_wake(_Atomic uint32_t *addr, int count) {
+     syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+ }
+ 
+ /**
+  * tells the cpu we are busy-waiting
+  */
+ static inline void cpu_relax() {
+ #if defined(__x86_64__) || defined(__i386__)
+     __builtin_ia32_pause();
+ #elif defined(__aarch64__)
+     __asm__ __volatile__("yield");
+ #endif
+ }
+ 
+ /**
+  * counts a migration when this turn runs on another cpu than the last one
+  */
+ static inline void track_cpu(thread_data_t *data) {
+     int cpu = sched_getcpu();
+     if (data->last_cpu >= 0 && cpu != data->last_cpu) {
+         data->migrations++;
+     }
+     data->last_cpu = cpu;
+ }
+ 
+ /*
+  * turn backends
+  * every backend takes turn k in printer k % ring_size and hands turn k + 1
+  * to the next printer. try_take never blocks and is what wait_turn spins
+  * on, block sleeps until the turn is here. the sync objects of all
+  * backends live in turn_syncs[] for as long as the pool.
+  */
+ 
+ /**
+  * returns printer i's sync objects
+  */
+ static inline turn_sync_t* turn_sync(int i) {
+     return (turn_sync_t *)((char *)turn_syncs + (size_t)i * turn_sync_stride);
+ }
+ 
+ /**
+  * returns the sync objects of the printer that owns the given turn
+  */
+ static inline turn_sync_t* turn_owner(const thread_data_t *data, size_t turn) {
+     return turn_sync((int)(turn % data->ring_size));
+ }
+ 
+ // semaphores: a token travels around the ring
+ 
+ int sem_try_take(thread_data_t *data, size_t turn) {
+     (void)turn;
+     return sem_trywait(&data->sync->sem) == 0;
+ }
+ 
+ void sem_block(thread_data_t *data, size_t turn) {
+     (void)turn;
+     while (sem_wait(&data->sync->sem) != 0) {
+     }
+ }
+ 
+ void sem_pass(thread_data_t *data, size_t turn) {
+     sem_post(&turn_owner(data, turn + 1)->sem);
+ }
+ 
+ void sem_arm() {
+     sem_post(&turn_sync(0)->sem);
+ }
+ 
+ // mutex and condition variable: a ready flag per printer, set under its lock
+ // but read without it first so the spin in wait_turn leaves the lock alone
+ 
+ int condvar_try_take(thread_data_t *data, size_t turn) {
+     (void)turn;
+     turn_sync_t *sync = data->sync;
+     if (!atomic_load_explicit(&sync->ready, memory_order_acquire)) {
+         return 0;
+     }
+     pthread_mutex_lock(&sync->lock);
+     atomic_store_explicit(&sync->ready, 0, memory_order_relaxed);
+     pthread_mutex_unlock(&sync->lock);
+     return 1;
+ }
+ 
+ void condvar_block(thread_data_t *data, size_t turn) {
+     (void)turn;
+     turn_sync_t *sync = data->sync;
+     pthread_mutex_lock(&sync->lock);
+     while (!atomic_load_explicit(&sync->ready, memory_order_relaxed)) {
+         pthread_cond_wait(&sync->cond, &sync->lock);
+     }
+     atomic_store_explicit(&sync->ready, 0, memory_order_relaxed);
+     pthread_mutex_unlock(&sync->lock);
+ }
+ 
+ void condvar_pass(thread_data_t *data, size_t turn) {
+     turn_sync_t *sync = turn_owner(data, turn + 1);
+     pthread_mutex_lock(&sync->lock);
+     atomic_store_explicit(&sync->ready, 1, memory_order_release);
+     pthread_cond_signal(&sync->cond);
+     pthread_mutex_unlock(&sync->lock);
+ }
+ 
+ void condvar_arm() {
+     atomic_store(&turn_sync(0)->ready, 1);
+ }
+ 
+ // eventfd: the turn is a count of one on the owner's (non-blocking) eventfd,
+ // announced by a flag first so the spin in wait_turn stays in userspace
+ 
+ int eventfd_try_take(thread_data_t *data, size_t turn) {
+     (void)turn;
+     turn_sync_t *sync = data->sync;
+     if (!atomic_load_explicit(&sync->posted, memory_order_acquire)) {
+         return 0;
+     }
+     uint64_t count;
+     if (read(sync->efd, &count, sizeof(count)) != sizeof(count)) {
+         return 0;
+     }
+     atomic_store_explicit(&sync->posted, 0, memory_order_relaxed);
+     return 1;
+ }
+ 
+ void eventfd_block(thread_data_t *data, size_t turn) {
+     struct pollfd pfd = {data->sync->efd, POLLIN, 0};
+     while (!eventfd_try_take(data, turn)) {
+         poll(&pfd, 1, -1);
+     }
+ }
+ 
+ void eventfd_pass(thread_data_t *data, size_t turn) {
+     turn_sync_t *owner = turn_owner(data, turn + 1);
+     uint64_t one = 1;
+     atomic_store_explicit(&owner->posted, 1, memory_order_release);
+     if (write(owner->efd, &one, sizeof(one)) != sizeof(one)) {
+         perror("eventfd write failed");
+         exit(EXIT_FAILURE);
+     }
+ }
+ 
+ void eventfd_arm() {
+     uint64_t one = 1;
+     atomic_store(&turn_sync(0)->posted, 1);
+     if (write(turn_sync(0)->efd, &one, sizeof(one)) != sizeof(one)) {
+         perror("eventfd write failed");
+         exit(EXIT_FAILURE);
+     }
+ }
+ 
+ // futex: a shared turn counter, the owner parks on its own futex word after
+ // flagging it and re-checks the counter in between so a wakeup cannot be missed
+ 
+ int counter_try_take(thread_data_t *data, size_t turn) {
+     (void)data;
+     return atomic_load(data->turn_counter) == turn;
+ }
+ 
+ void futex_block(thread_data_t *data, size_t turn) {
+     turn_sync_t *sync = data->sync;
+     while (atomic_load(data->turn_counter) != turn) {
+         atomic_store(&sync->parked, 1);
+         if (atomic_load(data->turn_counter) == turn) {
+             atomic_store(&sync->parked, 0);
+             break;
+         }
+         futex_wait(&sync->parked, 1);
+     }
+ }
+ 
+ /**
+  * only enters the kernel when the next owner is parked
+  */
+ void futex_pass(thread_data_t *data, size_t turn) {
+     turn_sync_t *owner = turn_owner(data, turn + 1);
+     atomic_store(data->turn_counter, turn + 1);
+     if (atomic_exchange(&owner->parked, 0) == 1) {
+         futex_wake(&owner->parked, 1);
+     }
+ }
+ 
+ // pure spinning: the shared counter again, nobody ever sleeps in the kernel.
+ // past the spin budget the waiter yields, which is all that keeps it usable
+ // with more printers than cpus
+ 
+ void spin_block(thread_data_t *data, size_t turn) {
+     while (!counter_try_take(data, turn)) {
+         data->yields++;
+         sched_yield();
+     }
+ }
+ 
+ void spin_pass(thread_data_t *data, size_t turn) {
+     (void)data;
+     atomic_store(data->turn_counter, turn + 1);
+ }
+ 
+ void counter_arm() {
+ }
+ 
+ const sync_ops_t sync_ops[SYNC_BACKEND_COUNT] = {
+     [SYNC_SEMAPHORE] = {"sem", 1, sem_arm, sem_try_take, sem_block, sem_pass},
+     [SYNC_CONDVAR] = {"condvar", 1, condvar_arm, condvar_try_take, condvar_block, condvar_pass},
+     [SYNC_EVENTFD] = {"eventfd", 1, eventfd_arm, eventfd_try_take, eventfd_block, eventfd_pass},
+     [SYNC_FUTEX] = {"futex", 1, counter_arm, counter_try_take, futex_block, futex_pass},
+     [SYNC_SPIN] = {"spin", 0, counter_arm, counter_try_take, spin_block, spin_pass},
+ };
+ 
+ /**
+  * blocks until the given turn has been passed to this thread
+  * spins for up to spin_budget pause iterations first, since the
+  * predecessor is often about to pass the turn. a turn caught while
+  * spinning doubles the budget (up to spin_limit) and a block halves it,
+  * so threads whose turns arrive quickly spin and the others sleep.
+  */
+ void wait_turn(thread_data_t *data, size_t turn) {
+     const sync_ops_t *ops = &sync_ops[sync_backend];
+     if (ops->try_take(data, turn)) {
+         return;
+     }
+     
+     for (int spin = 0; spin < data->spin_budget; spin++) {
+         cpu_relax();
+         if (ops->try_take(data, turn)) {
+             data->spin_hits++;
+             data->spin_budget = (data->spin_budget * 2 < spin_limit) ? data->spin_budget * 2 : spin_limit;
+             return;
+         }
+     }
+     
+     if (ops->sleeps) {
+         data->parks++;
+     }
+     if (data->spin_budget > 0) {
+         data->spin_budget = (data->spin_budget / 2 > MIN_SPIN_BUDGET) ? data->spin_budget / 2 : MIN_SPIN_BUDGET;
+         if (data->spin_budget > spin_limit) {
+             data->spin_budget = spin_limit;
+         }
+     }
+     
+     ops->block(data, turn);
+ }
+ 
+ /**
+  * hands the turn after the given one to the next thread in the ring
+  */
+ static inline void pass_turn(thread_data_t *data, size_t turn) {
+     sync_ops[sync_backend].pass(data, turn);
+ }
+ 
+ /*
+  * buffered output
+  * with -O writev printers format their lines into an arena of their own,
+  * before their turn where it fits, and the turn holder appends the
+  * segment to a shared batch of iovecs that goes out in one writev once it
+  * holds output_block bytes. a segment stays in its arena until the batch
+  * holding it is written, which bumps the batch generation: a printer that
+  * sees the generation move past the one it appended to may reuse its arena.
+  */
+ 
+ /**
+  * writes all of buf to fd, across short writes and signals
+  */
+ void write_all(int fd, const char *buf, size_t length) {
+     while (length > 0) {
+         ssize_t n = write(fd, buf, length);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             perror("write failed");
+             exit(EXIT_FAILURE);
+         }
+         buf += n;
+         length -= (size_t)n;
+     }
+ }
+ 
+ /**
+  * writes all of buf at the given file offset
+  */
+ void pwrite_all(int fd, const char *buf, size_t length, off_t offset) {
+     while (length > 0) {
+         ssize_t n = pwrite(fd, buf, length, offset);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             perror("pwrite failed");
+             exit(EXIT_FAILURE);
+         }
+         buf += n;
+         length -= (size_t)n;
+         offset += n;
+     }
+ }
+ 
+ /**
+  * writes every iovec to fd, resuming short writes where they stopped
+  * the iovecs are consumed in the process
+  */
+ void writev_all(int fd, struct iovec *iov, int count) {
+     while (count > 0) {
+         ssize_t n = writev(fd, iov, count);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             perror("writev failed");
+             exit(EXIT_FAILURE);
+         }
+         while (count > 0 && (size_t)n >= iov->iov_len) {
+             n -= iov->iov_len;
+             iov++;
+             count--;
+         }
+         if (count > 0) {
+             iov->iov_base = (char *)iov->iov_base + n;
+             iov->iov_len -= n;
+         }
+     }
+ }
+ 
+ /**
+  * returns an upper bound on the formatted size of words first to last - 1
+  */
+ size_t lines_bound(const word_index_t *index, size_t first, size_t last) {
+     size_t bound = 0;
+     for (size_t word_pos = first; word_pos < last; word_pos++) {
+         bound += index_word(index, word_pos)->length + LINE_OVERHEAD;
+     }
+     return bound;
+ }
+ 
+ /**
+  * formats one output line into dst, which has room for it
+  * the only variable parts are the thread's prefix, made once with the
+  * printers, and the word, so there is no format string to parse
+  * returns the length of the line
+  */
+ static inline size_t format_line(char *dst, int thread_id, const char *word, size_t length) {
+     const thread_data_t *owner = &printer_data[thread_id];
+     memcpy(dst, owner->prefix, owner->prefix_length);
+     memcpy(dst + owner->prefix_length, word, length);
+     dst[owner->prefix_length + length] = '\n';
+     return owner->prefix_length + length + 1;
+ }
+ 
+ /**
+  * prints one output line through stdio, as a unit even in chaos mode
+  */
+ static inline void print_line(int thread_id, const char *word, size_t length) {
+     const thread_data_t *owner = &printer_data[thread_id];
+     flockfile(stdout);
+     fwrite_unlocked(owner->prefix, 1, owner->prefix_length, stdout);
+     fwrite_unlocked(word, 1, length, stdout);
+     putc_unlocked('\n', stdout);
+     funlockfile(stdout);
+ }
+ 
+ /**
+  * formats the lines of words first to last - 1 into dst, returns their length
+  */
+ size_t format_lines(char *dst, int thread_id, const word_index_t *index, size_t first, size_t last) {
+     size_t length = 0;
+     for (size_t word_pos = first; word_pos < last; word_pos++) {
+         const word_span_t *word = index_word(index, word_pos);
+         length += format_line(dst + length, thread_id, index->text + word->offset, word->length);
+     }
+     return length;
+ }
+ 
+ /**
+  * makes room for size bytes in an arena with no segment in flight
+  */
+ void reserve_arena(output_arena_t *arena, size_t size) {
+     arena->length = 0;
+     if (arena->capacity >= size) {
+         return;
+     }
+     size_t capacity = (size > output_block) ? size : output_block;
+     free(arena->data);
+     arena->data = (char*)malloc(capacity);
+     if (arena->data == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     arena->capacity = capacity;
+ }
+ 
+ /*
+  * io_uring
+  * with -O uring a full batch is not written by the turn holder but queued
+  * as a WRITEV SQE pointing at the arenas, and the turn holder reaps the
+  * completions it finds on its way. batches retire in order, which is what
+  * out_batch.generation counts, so arenas are recycled exactly as with
+  * -O writev, just later. regular files get explicit offsets and up to
+  * URING_DEPTH writes in flight. pipes have no offsets and links do not
+  * span submissions, so batches queued while a chain is in flight are
+  * submitted together, linked in sequence, once it has completed.
+  */
+ 
+ /**
+  * sets up the ring on stdout, returns 0 or -1 with errno set
+  */
+ int uring_setup() {
+     struct io_uring_params params;
+     memset(&params, 0, sizeof(params));
+     int fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+     if (fd < 0) {
+         return -1;
+     }
+     
+     uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+     uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         if (uring.cq_ring_size > uring.sq_ring_size) {
+             uring.sq_ring_size = uring.cq_ring_size;
+         }
+         uring.cq_ring_size = 0;
+     }
+     uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+     
+     uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+     uring.cq_ring = uring.sq_ring;
+     if (uring.sq_ring != MAP_FAILED && uring.cq_ring_size > 0) {
+         uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              fd, IORING_OFF_CQ_RING);
+     }
+     uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQES);
+     if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+         close(fd);
+         return -1;
+     }
+     
+     char *sq = (char *)uring.sq_ring;
+     char *cq = (char *)uring.cq_ring;
+     uring.sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+     uring.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+     uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+     uring.cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+     uring.cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+     uring.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+     uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+     uring.fd = fd;
+     
+     // regular files take the writes at explicit offsets, in any order
+     struct stat st;
+     int flags = fcntl(STDOUT_FILENO, F_GETFL);
+     uring.seekable = (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+                       flags >= 0 && !(flags & O_APPEND));
+     return 0;
+ }
+ 
+ /**
+  * unmaps the ring
+  */
+ void uring_close() {
+     munmap(uring.sqes, uring.sqes_size);
+     if (uring.cq_ring != uring.sq_ring) {
+         munmap(uring.cq_ring, uring.cq_ring_size);
+     }
+     munmap(uring.sq_ring, uring.sq_ring_size);
+     close(uring.fd);
+ }
+ 
+ /**
+  * hands the queued SQEs to the kernel, unless a chain on a pipe is still
+  * in flight and they have to wait for it
+  */
+ void uring_kick() {
+     unsigned long pending = uring.queued - uring.submitted;
+     if (pending == 0) {
+         return;
+     }
+     if (!uring.seekable) {
+         if (atomic_load(&out_batch.generation) < uring.submitted) {
+             return;
+         }
+         for (unsigned long b = uring.submitted; b < uring.queued; b++) {
+             uring.sqes[b % URING_DEPTH].flags = (b + 1 < uring.queued) ? IOSQE_IO_LINK : 0;
+         }
+     }
+     
+     while (pending > 0) {
+         int n = (int)syscall(__NR_io_uring_enter, uring.fd, (unsigned)pending, 0, 0, NULL, 0);
+         if (n < 0) {
+             if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                 continue;
+             }
+             perror("io_uring_enter failed");
+             exit(EXIT_FAILURE);
+         }
+         pending -= (unsigned long)n;
+         uring.submitted += (unsigned long)n;
+     }
+ }
+ 
+ /**
+  * finishes a write the kernel cut short (or cancelled with its chain)
+  * synchronously, nothing after it on a pipe is in flight
+  */
+ void uring_complete_short(uring_slot_t *slot, size_t written) {
+     off_t offset = slot->offset + (off_t)written;
+     for (int i = 0; i < slot->count; i++) {
+         const char *base = (const char *)slot->iov[i].iov_base;
+         size_t length = slot->iov[i].iov_len;
+         if (written >= length) {
+             written -= length;
+             continue;
+         }
+         base += written;
+         length -= written;
+         written = 0;
+         if (uring.seekable) {
+             pwrite_all(STDOUT_FILENO, base, length, offset);
+             offset += (off_t)length;
+         } else {
+             write_all(STDOUT_FILENO, base, length);
+         }
+     }
+ }
+ 
+ /**
+  * processes the completions that arrived, waiting for one first if asked,
+  * and retires batches in order
+  */
+ void uring_reap(int wait) {
+     if (wait) {
+         int n = (int)syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+         if (n < 0 && errno != EINTR) {
+             perror("io_uring_enter failed");
+             exit(EXIT_FAILURE);
+         }
+     }
+     
+     unsigned head = atomic_load_explicit(uring.cq_head, memory_order_relaxed);
+     unsigned tail = atomic_load_explicit(uring.cq_tail, memory_order_acquire);
+     for (; head != tail; head++) {
+         const struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+         uring_slot_t *slot = &uring.slots[cqe->user_data];
+         if (cqe->res < 0 && cqe->res != -ECANCELED) {
+             fprintf(stderr, "io_uring write failed: %s\n", strerror(-cqe->res));
+             exit(EXIT_FAILURE);
+         }
+         size_t written = (cqe->res < 0) ? 0 : (size_t)cqe->res;
+         if (written < slot->bytes) {
+             uring_complete_short(slot, written);
+         }
+         slot->done = 1;
+     }
+     atomic_store_explicit(uring.cq_head, head, memory_order_release);
+     
+     unsigned long retired = atomic_load(&out_batch.generation);
+     while (retired < uring.submitted && uring.slots[retired % URING_DEPTH].done) {
+         uring.slots[retired % URING_DEPTH].done = 0;
+         retired++;
+     }
+     atomic_store_explicit(&out_batch.generation, retired, memory_order_release);
+ }
+ 
+ /**
+  * queues the batch as a WRITEV SQE and submits what may be submitted
+  * the iovecs are copied into the batch's slot, the lines stay in the arenas
+  */
+ void uring_queue_batch() {
+     // every slot in flight: this is the only place a printer waits for the disk
+     while (uring.queued - atomic_load(&out_batch.generation) >= URING_DEPTH) {
+         uring_kick();
+         uring_reap(1);
+     }
+     
+     unsigned index = (unsigned)(uring.queued % URING_DEPTH);
+     uring_slot_t *slot = &uring.slots[index];
+     memcpy(slot->iov, out_batch.iov, out_batch.count * sizeof(struct iovec));
+     slot->count = out_batch.count;
+     slot->bytes = out_batch.bytes;
+     slot->offset = uring.offset;
+     if (uring.seekable) {
+         uring.offset += (off_t)out_batch.bytes;
+     }
+     
+     struct io_uring_sqe *sqe = &uring.sqes[index];
+     memset(sqe, 0, sizeof(*sqe));
+     sqe->opcode = IORING_OP_WRITEV;
+     sqe->fd = STDOUT_FILENO;
+     sqe->addr = (uint64_t)(uintptr_t)slot->iov;
+     sqe->len = (uint32_t)slot->count;
+     sqe->off = uring.seekable ? (uint64_t)slot->offset : (uint64_t)-1;
+     sqe->user_data = index;
+     
+     unsigned tail = atomic_load_explicit(uring.sq_tail, memory_order_relaxed);
+     uring.sq_array[tail & uring.sq_mask] = index;
+     atomic_store_explicit(uring.sq_tail, tail + 1, memory_order_release);
+     uring.queued++;
+     
+     uring_kick();
+     uring_reap(0);
+ }
+ 
+ /**
+  * waits until every queued batch is written and moves the file offset past them
+  */
+ void uring_drain() {
+     while (atomic_load(&out_batch.generation) < uring.queued) {
+         uring_kick();
+         uring_reap(1);
+     }
+     
+     // the reorder emitter writes through the file offset instead, leave it be
+     if (uring.seekable && uring.queued != uring.drained &&
+         lseek(STDOUT_FILENO, uring.offset, SEEK_SET) < 0) {
+         perror("lseek failed");
+         exit(EXIT_FAILURE);
+     }
+     uring.drained = uring.queued;
+ }
+ 
+ /**
+  * writes the batch out (or queues it with -O uring), only ever called by
+  * the turn holder or once the printers are done
+  */
+ void flush_batch() {
+     if (output_mode == OUTPUT_URING) {
+         uring_queue_batch();
+     } else {
+         writev_all(STDOUT_FILENO, out_batch.iov, out_batch.count);
+         atomic_fetch_add_explicit(&out_batch.generation, 1, memory_order_release);
+     }
+     out_batch.count = 0;
+     out_batch.bytes = 0;
+     out_batch.flushed++;
+ }
+ 
+ /*
+  * writer thread
+  * with -O writer the turn holder copies its lines into one of two blocks
+  * and a dedicated thread writes the other one, so printers only ever
+  * hand off to memory and every write carries a whole block.
+  */
+ 
+ /**
+  * thread function of the writer, writes blocks as they are handed over
+  */
+ void* writer_main(void *arg) {
+     (void)arg;
+     
+     pthread_mutex_lock(&writer.lock);
+     for (;;) {
+         while (writer.pending < 0 && !writer.stop) {
+             pthread_cond_wait(&writer.cond, &writer.lock);
+         }
+         if (writer.pending < 0) {
+             break;
+         }
+         int b = writer.pending;
+         pthread_mutex_unlock(&writer.lock);
+         
+         write_all(STDOUT_FILENO, writer.blocks[b], writer.length[b]);
+         
+         pthread_mutex_lock(&writer.lock);
+         writer.length[b] = 0;
+         writer.writes++;
+         writer.pending = -1;
+         pthread_cond_broadcast(&writer.cond);
+     }
+     pthread_mutex_unlock(&writer.lock);
+     
+     return NULL;
+ }
+ 
+ /**
+  * hands the block being filled to the writer and fills the other one,
+  * once the writer is done with it
+  */
+ void writer_submit() {
+     pthread_mutex_lock(&writer.lock);
+     while (writer.pending >= 0) {
+         pthread_cond_wait(&writer.cond, &writer.lock);
+     }
+     writer.pending = writer.fill;
+     writer.fill ^= 1;
+     pthread_cond_broadcast(&writer.cond);
+     pthread_mutex_unlock(&writer.lock);
+ }
+ 
+ /**
+  * copies lines into the current block, only ever called by the turn
+  * holder (or the reorder emitter)
+  * a block goes to the writer when full or, on a terminal, every call
+  */
+ void writer_append(const char *buf, size_t length) {
+     while (length > 0) {
+         size_t *used = &writer.length[writer.fill];
+         size_t n = writer.capacity - *used;
+         if (n > length) {
+             n = length;
+         }
+         memcpy(writer.blocks[writer.fill] + *used, buf, n);
+         *used += n;
+         buf += n;
+         length -= n;
+         if (*used == writer.capacity) {
+             writer_submit();
+         }
+     }
+     
+     if (writer.length[writer.fill] > 0 && writer.length[writer.fill] >= output_block) {
+         writer_submit();
+     }
+ }
+ 
+ /**
+  * submits the partial block and waits until everything is written
+  */
+ void writer_drain() {
+     if (writer.length[writer.fill] > 0) {
+         writer_submit();
+     }
+     pthread_mutex_lock(&writer.lock);
+     while (writer.pending >= 0) {
+         pthread_cond_wait(&writer.cond, &writer.lock);
+     }
+     pthread_mutex_unlock(&writer.lock);
+ }
+ 
+ /**
+  * allocates the two blocks and starts the writer
+  */
+ void start_writer() {
+     writer.capacity = (output_block > WRITER_BLOCK) ? output_block : WRITER_BLOCK;
+     for (int b = 0; b < 2; b++) {
+         writer.blocks[b] = (char*)malloc(writer.capacity);
+         if (writer.blocks[b] == NULL) {
+             perror("malloc failed");
+             exit(EXIT_FAILURE);
+         }
+         writer.length[b] = 0;
+     }
+     writer.fill = 0;
+     writer.pending = -1;
+     writer.stop = 0;
+     writer.writes = 0;
+     pthread_mutex_init(&writer.lock, NULL);
+     pthread_cond_init(&writer.cond, NULL);
+     
+     int err = pthread_create(&writer.thread, NULL, writer_main, NULL);
+     if (err != 0) {
+         fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+         exit(EXIT_FAILURE);
+     }
+ }
+ 
+ /**
+  * writes what is left, stops the writer and frees the blocks
+  */
+ void stop_writer() {
+     writer_drain();
+     
+     pthread_mutex_lock(&writer.lock);
+     writer.stop = 1;
+     pthread_cond_broadcast(&writer.cond);
+     pthread_mutex_unlock(&writer.lock);
+     pthread_join(writer.thread, NULL);
+     
+     pthread_mutex_destroy(&writer.lock);
+     pthread_cond_destroy(&writer.cond);
+     free(writer.blocks[0]);
+     free(writer.blocks[1]);
+ }
+ 
+ /*
+  * vmsplice
+  * with -O splice stdout is a pipe. the turn holder copies its lines into
+  * a page-aligned block mapped for the purpose, and a full block is gifted
+  * to the pipe with vmsplice: the kernel takes the pages over instead of
+  * copying them, and the block is unmapped and replaced, never written again.
+  */
+ 
+ /**
+  * maps a fresh block to fill
+  */
+ void splice_map_block() {
+     void *block = mmap(NULL, gift.capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     if (block == MAP_FAILED) {
+         perror("mmap failed");
+         exit(EXIT_FAILURE);
+     }
+     gift.block = (char *)block;
+     gift.length = 0;
+ }
+ 
+ /**
+  * gifts the filled part of the block to the pipe and starts a new block
+  * only whole pages can be taken over, a partial last page is referenced
+  * by the pipe instead, which is just as safe since it is never reused
+  */
+ void splice_flush() {
+     if (gift.length == 0) {
+         return;
+     }
+     
+     struct iovec iov = {gift.block, gift.length};
+     while (iov.iov_len > 0) {
+         ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_GIFT);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             perror("vmsplice failed");
+             exit(EXIT_FAILURE);
+         }
+         iov.iov_base = (char *)iov.iov_base + n;
+         iov.iov_len -= (size_t)n;
+     }
+     gift.gifts++;
+     
+     munmap(gift.block, gift.capacity);
+     splice_map_block();
+ }
+ 
+ /**
+  * copies lines into the block, only ever called by the turn holder (or
+  * the reorder emitter)
+  */
+ void splice_append(const char *buf, size_t length) {
+     while (length > 0) {
+         size_t n = gift.capacity - gift.length;
+         if (n > length) {
+             n = length;
+         }
+         memcpy(gift.block + gift.length, buf, n);
+         gift.length += n;
+         buf += n;
+         length -= n;
+         if (gift.length == gift.capacity) {
+             splice_flush();
+         }
+     }
+     
+     if (gift.length >= output_block) {
+         splice_flush();
+     }
+ }
+ 
+ /**
+  * checks that stdout is a pipe and maps the first block
+  * returns 0, or -1 when stdout is something else
+  */
+ int splice_setup() {
+     struct stat st;
+     if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+         return -1;
+     }
+     
+     // whole pages only, and a pipe large enough to take a block at once
+     size_t page = (size_t)sysconf(_SC_PAGESIZE);
+     gift.capacity = (output_block > page) ? (output_block + page - 1) / page * page : page;
+     fcntl(STDOUT_FILENO, F_SETPIPE_SZ, (int)gift.capacity);
+     splice_map_block();
+     return 0;
+ }
+ 
+ /**
+  * hands finished lines on to stdout, through the writer or the gift block
+  * when there is one
+  */
+ static inline void emit_output(const char *buf, size_t length) {
+     if (output_mode == OUTPUT_WRITER) {
+         writer_append(buf, length);
+     } else if (output_mode == OUTPUT_SPLICE) {
+         splice_append(buf, length);
+     } else {
+         write_all(STDOUT_FILENO, buf, length);
+     }
+ }
+ 
+ /**
+  * prints one turn's words through the batch, see above
+  * chaos mode has no turns, each chunk goes out in a write of its own
+  */
+ void print_chunk_buffered(thread_data_t *data, size_t turn, size_t first, size_t last) {
+     output_arena_t *arena = &data->out;
+     
+     // add random delay (10-100ms) before the turn, nothing is printed yet
+     if (!benchmark_mode) {
+         for (size_t word_pos = first; word_pos < last; word_pos++) {
+             usleep((rand() % 91 + 10) * 1000);
+         }
+     }
+     
+     size_t bound = lines_bound(data->index, first, last);
+     if (data->mode == MODE_CHAOS) {
+         reserve_arena(arena, bound);
+         size_t length = format_lines(arena->data, data->thread_id, data->index, first, last);
+         track_cpu(data);
+         write_all(STDOUT_FILENO, arena->data, length);
+         return;
+     }
+     
+     // the lines are copied out, so the arena is free again after the turn
+     if (output_mode == OUTPUT_WRITER || output_mode == OUTPUT_SPLICE) {
+         reserve_arena(arena, bound);
+         size_t length = format_lines(arena->data, data->thread_id, data->index, first, last);
+         wait_turn(data, turn);
+         track_cpu(data);
+         emit_output(arena->data, length);
+         pass_turn(data, turn);
+         
+         // wait for a short time to ensure proper order
+         if (!benchmark_mode) {
+             usleep(1000);
+         }
+         return;
+     }
+     
+     // the arena is free again once the batch our last segment went into is out
+     if (atomic_load_explicit(&out_batch.generation, memory_order_acquire) > arena->generation) {
+         arena->length = 0;
+     }
+     
+     // format ahead of the turn when it fits behind the segments in flight
+     int formatted = (arena->length + bound <= arena->capacity);
+     size_t start = arena->length;
+     size_t length = 0;
+     if (formatted) {
+         length = format_lines(arena->data + start, data->thread_id, data->index, first, last);
+     }
+     
+     wait_turn(data, turn);
+     track_cpu(data);
+     
+     if (!formatted) {
+         // holding the turn, we may write out our own segments to make room
+         if (arena->length > 0) {
+             if (arena->generation == out_batch.flushed) {
+                 flush_batch();
+             }
+             while (atomic_load(&out_batch.generation) <= arena->generation) {
+                 uring_kick();
+                 uring_reap(1);
+             }
+         }
+         reserve_arena(arena, bound);
+         start = 0;
+         length = format_lines(arena->data, data->thread_id, data->index, first, last);
+     }
+     arena->length = start + length;
+     arena->generation = out_batch.flushed;
+     
+     out_batch.iov[out_batch.count].iov_base = arena->data + start;
+     out_batch.iov[out_batch.count].iov_len = length;
+     out_batch.count++;
+     out_batch.bytes += length;
+     if (out_batch.bytes >= output_block || out_batch.count == IOV_MAX) {
+         flush_batch();
+     }
+     
+     pass_turn(data, turn);
+     
+     // wait for a short time to ensure proper order
+     if (!benchmark_mode) {
+         usleep(1000);
+     }
+ }
+ 
+ /*
+  * reorder buffer
+  * word i travels through slot i % REORDER_SLOTS. the slot's seq is i while
+  * it is free for word i and i + 1 once the word is stored, and the
+  * emitter frees it for word i + REORDER_SLOTS after printing. printers
+  * only wait when they run a whole buffer ahead of the emitter.
+  */
+ 
+ /**
+  * waits until a reorder slot reaches the given sequence number
+  */
+ void reorder_wait(reorder_slot_t *slot, uint32_t seq) {
+     for (int spin = 0; spin < spin_limit; spin++) {
+         if (atomic_load(&slot->seq) == seq) {
+             return;
+         }
+         cpu_relax();
+     }
+     
+     for (;;) {
+         uint32_t current = atomic_load(&slot->seq);
+         if (current == seq) {
+             return;
+         }
+         // futex_wait returns at once if seq moved after it was read
+         atomic_fetch_add(&slot->waiters, 1);
+         futex_wait(&slot->seq, current);
+         atomic_fetch_sub(&slot->waiters, 1);
+     }
+ }
+ 
+ /**
+  * moves a reorder slot to the given sequence number and wakes its waiters
+  */
+ static inline void reorder_publish(reorder_slot_t *slot, uint32_t seq) {
+     atomic_store(&slot->seq, seq);
+     if (atomic_load(&slot->waiters) != 0) {
+         futex_wake(&slot->seq, INT32_MAX);
+     }
+ }
+ 
+ /**
+  * stores a word in the reorder buffer
+  */
+ void reorder_put(size_t word_pos, int thread_id, const word_span_t *word) {
+     reorder_slot_t *slot = &reorder_slots[word_pos % REORDER_SLOTS];
+     reorder_wait(slot, (uint32_t)word_pos);
+     slot->thread_id = thread_id;
+     slot->word = word;
+     reorder_publish(slot, (uint32_t)(word_pos + 1));
+ }
+ 
+ /**
+  * prints every word of the document in order as it arrives in the buffer
+  */
+ void reorder_drain(const word_index_t *index) {
+     for (size_t i = 0; i < index->count; i++) {
+         reorder_slot_t *slot = &reorder_slots[i % REORDER_SLOTS];
+         reorder_wait(slot, (uint32_t)(i + 1));
+         if (output_mode == OUTPUT_STDIO) {
+             print_line(slot->thread_id, index->text + slot->word->offset, slot->word->length);
+         } else {
+             // a single writer needs no batch, just its own buffer
+             output_arena_t *arena = &emitter_out;
+             if (arena->length + slot->word->length + LINE_OVERHEAD > arena->capacity) {
+                 emit_output(arena->data, arena->length);
+                 reserve_arena(arena, slot->word->length + LINE_OVERHEAD);
+             }
+             arena->length += format_line(arena->data + arena->length, slot->thread_id,
+                                          index->text + slot->word->offset, slot->word->length);
+             if (arena->length >= output_block) {
+                 emit_output(arena->data, arena->length);
+                 arena->length = 0;
+             }
+         }
+         reorder_publish(slot, (uint32_t)(i + REORDER_SLOTS));
+     }
+     
+     if (emitter_out.length > 0) {
+         emit_output(emitter_out.data, emitter_out.length);
+         emitter_out.length = 0;
+     }
+ }
+ 
+ /**
+  * thread function that prints assigned words
+  * waits for its turn, prints its part, and passes the turn to the next thread
+  */
+ void* print_thread(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     
+     // loop through the turns of this thread, each covering chunk_size words
+     for (size_t i = 0; i < data->turn_count; i++) {
+         size_t turn = data->first_turn + i * data->ring_size;
+         size_t first = turn * data->chunk_size;
+         size_t last = first + data->chunk_size;
+         if (last > data->index->count) {
+             last = data->index->count;
+         }
+         
+         if (output_mode != OUTPUT_STDIO && data->mode != MODE_REORDER) {
+             print_chunk_buffered(data, turn, first, last);
+             continue;
+         }
+         
+         if (data->mode == MODE_NORMAL) {
+             // normal mode - wait for the previous words to be printed
+             wait_turn(data, turn);
+         }
+         track_cpu(data);
+         
+         for (size_t word_pos = first; word_pos < last; word_pos++) {
+             // add random delay (10-100ms)
+             if (!benchmark_mode) {
+                 usleep((rand() % 91 + 10) * 1000);
+             }
+             
+             const word_span_t *word = index_word(data->index, word_pos);
+             
+             if (data->mode == MODE_REORDER) {
+                 // reorder mode - leave the printing to the emitter
+                 reorder_put(word_pos, data->thread_id, word);
+                 continue;
+             }
+             
+             // print the word and add a newline after every thread's print
+             print_line(data->thread_id, data->index->text + word->offset, word->length);
+         }
+         
+         if (data->mode == MODE_NORMAL) {
+             // normal mode - signal the next thread
+             pass_turn(data, turn);
+             
+             // wait for a short time to ensure proper order
+             if (!benchmark_mode) {
+                 usleep(1000);
+             }
+         }
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * starts a thread's adaptive spinning and statistics afresh for a new run
+  */
+ void reset_thread_stats(thread_data_t *data) {
+     data->spin_budget = spin_limit;
+     data->spin_hits = 0;
+     data->parks = 0;
+     data->yields = 0;
+     data->last_cpu = -1;
+     data->migrations = 0;
+ }
+ 
+ /**
+  * parses a cpu list such as "0-3,8" into an array
+  * returns the number of cpus, or -1 if the list is malformed
+  */
+ int parse_cpu_list(const char *list, int **cpus) {
+     int count = 0;
+     int capacity = 16;
+     *cpus = (int*)malloc(capacity * sizeof(int));
+     if (*cpus == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     const char *p = list;
+     while (*p != '\0') {
+         char *end;
+         long first = strtol(p, &end, 10);
+         if (end == p || first < 0 || first >= CPU_SETSIZE) {
+             return -1;
+         }
+         long last = first;
+         if (*end == '-') {
+             p = end + 1;
+             last = strtol(p, &end, 10);
+             if (end == p || last < first || last >= CPU_SETSIZE) {
+                 return -1;
+             }
+         }
+         
+         for (long cpu = first; cpu <= last; cpu++) {
+             if (count == capacity) {
+                 capacity *= 2;
+                 int *grown = (int*)realloc(*cpus, capacity * sizeof(int));
+                 if (grown == NULL) {
+                     perror("realloc failed");
+                     exit(EXIT_FAILURE);
+                 }
+                 *cpus = grown;
+             }
+             (*cpus)[count++] = (int)cpu;
+         }
+         
+         if (*end == ',') {
+             end++;
+         } else if (*end != '\0') {
+             return -1;
+         }
+         p = end;
+     }
+     
+     return count > 0 ? count : -1;
+ }
+ 
+ /**
+  * reads an integer from a sysfs file named by a format taking a cpu number
+  * returns fallback when the file is missing, as on kernels without it
+  */
+ int read_cpu_sysfs_int(const char *format, int cpu, int index, int fallback) {
+     char path[256];
+     snprintf(path, sizeof(path), format, cpu, index);
+     
+     FILE *f = fopen(path, "r");
+     if (f == NULL) {
+         return fallback;
+     }
+     int value;
+     if (fscanf(f, "%d", &value) != 1) {
+         value = fallback;
+     }
+     fclose(f);
+     return value;
+ }
+ 
+ /**
+  * returns the id of the last level (l3) cache a cpu uses
+  */
+ int cpu_l3_id(int cpu) {
+     for (int index = 0; index < 16; index++) {
+         int level = read_cpu_sysfs_int("/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+                                        cpu, index, -1);
+         if (level < 0) {
+             break;
+         }
+         if (level == 3) {
+             return read_cpu_sysfs_int("/sys/devices/system/cpu/cpu%d/cache/index%d/id", cpu, index, 0);
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * returns the numa node of a cpu, from the nodeN link in its sysfs directory
+  */
+ int cpu_numa_node(int cpu) {
+     char path[64];
+     snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+     
+     DIR *dir = opendir(path);
+     if (dir == NULL) {
+         return 0;
+     }
+     int node = 0;
+     struct dirent *entry;
+     while ((entry = readdir(dir)) != NULL) {
+         if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+             node = atoi(entry->d_name + 4);
+             break;
+         }
+     }
+     closedir(dir);
+     return node;
+ }
+ 
+ /**
+  * orders cpus by numa node, socket, l3 cache and core
+  */
+ int compare_topology(const void *a, const void *b) {
+     const cpu_topology_t *x = (const cpu_topology_t *)a;
+     const cpu_topology_t *y = (const cpu_topology_t *)b;
+     if (x->node != y->node) {
+         return x->node - y->node;
+     }
+     if (x->package != y->package) {
+         return x->package - y->package;
+     }
+     if (x->l3 != y->l3) {
+         return x->l3 - y->l3;
+     }
+     if (x->core != y->core) {
+         return x->core - y->core;
+     }
+     return x->cpu - y->cpu;
+ }
+ 
+ /**
+  * sorts a cpu list so that neighbours share as much of the cache
+  * hierarchy as possible: smt siblings first, then cores of one l3, then
+  * l3 domains of one socket, then sockets of one numa node. a ring over
+  * the sorted list crosses each l3, socket and node boundary once per lap.
+  */
+ void order_cpus_by_topology(int *cpus, int count) {
+     cpu_topology_t *topology = (cpu_topology_t*)malloc(count * sizeof(cpu_topology_t));
+     if (topology == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     for (int i = 0; i < count; i++) {
+         int cpu = cpus[i];
+         topology[i].cpu = cpu;
+         topology[i].node = cpu_numa_node(cpu);
+         topology[i].package = read_cpu_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+                                                  cpu, 0, 0);
+         topology[i].l3 = cpu_l3_id(cpu);
+         topology[i].core = read_cpu_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, 0, cpu);
+     }
+     
+     qsort(topology, count, sizeof(cpu_topology_t), compare_topology);
+     
+     for (int i = 0; i < count; i++) {
+         cpus[i] = topology[i].cpu;
+         if (verbose) {
+             fprintf(stderr, "ring position %d: cpu %d (node %d, package %d, l3 %d, core %d)\n", i,
+                     topology[i].cpu, topology[i].node, topology[i].package, topology[i].l3, topology[i].core);
+         }
+     }
+     
+     free(topology);
+ }
+ 
+ /**
+  * reads the list of online cpus
+  * returns the number of cpus, or -1 if it cannot be read
+  */
+ int online_cpu_list(int **cpus) {
+     char list[4096];
+     FILE *f = fopen("/sys/devices/system/cpu/online", "r");
+     if (f == NULL) {
+         return -1;
+     }
+     if (fgets(list, sizeof(list), f) == NULL) {
+         fclose(f);
+         return -1;
+     }
+     fclose(f);
+     
+     list[strcspn(list, "\n")] = '\0';
+     return parse_cpu_list(list, cpus);
+ }
+ 
+ /**
+  * starts printer i running fn, pinned to its cpu when pinning is on
+  */
+ void create_printer(int i, void *(*fn)(void *)) {
+     pthread_attr_t attr;
+     pthread_attr_init(&attr);
+     printer_data[i].cpu = -1;
+     
+     if (pin_cpu_count > 0) {
+         // setting the affinity before the thread starts means it never runs elsewhere
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         printer_data[i].cpu = pin_cpus[i % pin_cpu_count];
+         CPU_SET(printer_data[i].cpu, &set);
+         pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+     }
+     
+     // pthread functions return the error instead of setting errno
+     int err = pthread_create(&printer_threads[i], &attr, fn, &printer_data[i]);
+     if (err != 0) {
+         fprintf(stderr, "pthread_create failed: %s%s\n", strerror(err),
+                 printer_data[i].cpu >= 0 ? " (is the pinned cpu online?)" : "");
+         exit(EXIT_FAILURE);
+     }
+     pthread_attr_destroy(&attr);
+ }
+ 
+ /**
+  * fills in a printer's share of a job
+  * printer i takes turns i, i + active, i + 2 * active, ... and turn k prints
+  * words k * chunk_size up to (k + 1) * chunk_size, straight from the shared
+  * index, so no per-job allocation is needed
+  */
+ void assign_job(thread_data_t *data, const print_job_t *job) {
+     int i = data->thread_id;
+     data->index = job->index;
+     data->mode = job->mode;
+     data->first_turn = i;
+     data->turn_count = (job->turns - i + job->active - 1) / job->active;
+     data->chunk_size = job->chunk_size;
+     data->ring_size = job->active;
+     data->turn_counter = turn_counter;
+     data->out.length = 0;
+     reset_thread_stats(data);
+ }
+ 
+ /**
+  * thread function of a pooled printer
+  * parks until a job is posted, runs its share of it and parks again
+  */
+ void* printer_main(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     unsigned long seen = 0;
+     
+     for (;;) {
+         pthread_mutex_lock(&pool.lock);
+         while (pool.generation == seen && !pool.stop) {
+             pthread_cond_wait(&pool.job_ready, &pool.lock);
+         }
+         if (pool.stop) {
+             pthread_mutex_unlock(&pool.lock);
+             break;
+         }
+         seen = pool.generation;
+         print_job_t job = pool.job;
+         pthread_mutex_unlock(&pool.lock);
+         
+         // printers beyond the ring sit this job out
+         if (data->thread_id >= job.active) {
+             continue;
+         }
+         
+         assign_job(data, &job);
+         job.run(data);
+         
+         pthread_mutex_lock(&pool.lock);
+         if (++pool.finished == job.active) {
+             pthread_cond_signal(&pool.job_done);
+         }
+         pthread_mutex_unlock(&pool.lock);
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * hands the first turn to printer 0 ahead of a job
+  * the sync objects live as long as the pool: the turn the last run left
+  * with one of the printers is drained rather than recreating them all
+  */
+ void arm_turns() {
+     for (int i = 0; i < pool_size; i++) {
+         turn_sync_t *sync = turn_sync(i);
+         uint64_t count;
+         while (sem_trywait(&sync->sem) == 0) {
+         }
+         while (read(sync->efd, &count, sizeof(count)) == sizeof(count)) {
+         }
+         atomic_store(&sync->ready, 0);
+         atomic_store(&sync->posted, 0);
+         atomic_store(&sync->parked, 0);
+     }
+     atomic_store(turn_counter, 0);
+     sync_ops[sync_backend].arm();
+ }
+ 
+ /**
+  * posts a job to the pool, the printers start on it right away
+  */
+ void start_job(const print_job_t *job) {
+     arm_turns();
+     
+     pthread_mutex_lock(&pool.lock);
+     pool.job = *job;
+     pool.finished = 0;
+     pool.generation++;
+     pthread_cond_broadcast(&pool.job_ready);
+     pthread_mutex_unlock(&pool.lock);
+ }
+ 
+ /**
+  * waits until every printer of the current job is done
+  */
+ void finish_job() {
+     pthread_mutex_lock(&pool.lock);
+     while (pool.finished < pool.job.active) {
+         pthread_cond_wait(&pool.job_done, &pool.lock);
+     }
+     pthread_mutex_unlock(&pool.lock);
+ }
+ 
+ /**
+  * allocates zeroed memory starting on a cache line
+  * malloc only guarantees 16 bytes, too little for the padded types
+  */
+ void* alloc_cache_aligned(size_t size) {
+     void *ptr = NULL;
+     int err = posix_memalign(&ptr, CACHE_LINE_SIZE, size);
+     if (err != 0) {
+         fprintf(stderr, "posix_memalign failed: %s\n", strerror(err));
+         exit(EXIT_FAILURE);
+     }
+     memset(ptr, 0, size);
+     return ptr;
+ }
+ 
+ /**
+  * creates the pool's sync objects stride bytes apart
+  */
+ void init_turn_syncs(size_t stride) {
+     turn_sync_stride = stride;
+     for (int i = 0; i < pool_size; i++) {
+         turn_sync_t *sync = turn_sync(i);
+         memset(sync, 0, sizeof(*sync));
+         if (sem_init(&sync->sem, 0, 0) != 0) {
+             perror("sem_init failed");
+             exit(EXIT_FAILURE);
+         }
+         pthread_mutex_init(&sync->lock, NULL);
+         pthread_cond_init(&sync->cond, NULL);
+         sync->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         if (sync->efd < 0) {
+             perror("eventfd failed");
+             exit(EXIT_FAILURE);
+         }
+         if (printer_data != NULL) {
+             printer_data[i].sync = sync;
+         }
+     }
+ }
+ 
+ /**
+  * destroys the pool's sync objects, the printers must be parked
+  */
+ void destroy_turn_syncs() {
+     for (int i = 0; i < pool_size; i++) {
+         turn_sync_t *sync = turn_sync(i);
+         sem_destroy(&sync->sem);
+         pthread_mutex_destroy(&sync->lock);
+         pthread_cond_destroy(&sync->cond);
+         close(sync->efd);
+     }
+ }
+ 
+ /**
+  * allocates the sync objects for n printers and starts them parked
+  */
+ void alloc_printers(int n) {
+     pool_size = n;
+     num_threads = n;
+     // room for the padded layout plus the counter -B sharing packs behind it
+     turn_syncs = (turn_sync_t*)alloc_cache_aligned(n * TURN_SYNC_PADDED + CACHE_LINE_SIZE);
+     printer_data = (thread_data_t*)alloc_cache_aligned(n * sizeof(thread_data_t));
+     reorder_slots = (reorder_slot_t*)alloc_cache_aligned(REORDER_SLOTS * sizeof(reorder_slot_t));
+     sharing_slots = (char*)alloc_cache_aligned(n * CACHE_LINE_SIZE);
+     printer_threads = (pthread_t*)malloc(n * sizeof(pthread_t));
+     if (printer_threads == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     init_turn_syncs(TURN_SYNC_PADDED);
+     
+     pthread_mutex_init(&pool.lock, NULL);
+     pthread_cond_init(&pool.job_ready, NULL);
+     pthread_cond_init(&pool.job_done, NULL);
+     pool.generation = 0;
+     pool.finished = 0;
+     pool.stop = 0;
+     
+     for (int i = 0; i < n; i++) {
+         printer_data[i].thread_id = i;
+         printer_data[i].sync = turn_sync(i);
+         printer_data[i].prefix_length = (size_t)snprintf(printer_data[i].prefix, sizeof(printer_data[i].prefix),
+                                                          "Thread %d: ", i + 1);
+         create_printer(i, printer_main);
+     }
+ }
+ 
+ /**
+  * stops the printers and frees what alloc_printers allocated
+  */
+ void free_printers() {
+     pthread_mutex_lock(&pool.lock);
+     pool.stop = 1;
+     pthread_cond_broadcast(&pool.job_ready);
+     pthread_mutex_unlock(&pool.lock);
+     
+     for (int i = 0; i < pool_size; i++) {
+         pthread_join(printer_threads[i], NULL);
+         free(printer_data[i].out.data);
+     }
+     destroy_turn_syncs();
+     pthread_mutex_destroy(&pool.lock);
+     pthread_cond_destroy(&pool.job_ready);
+     pthread_cond_destroy(&pool.job_done);
+     
+     free(turn_syncs);
+     free(printer_threads);
+     free(printer_data);
+     free(reorder_slots);
+     free(sharing_slots);
+     free(emitter_out.data);
+     memset(&emitter_out, 0, sizeof(emitter_out));
+     reorder_slots = NULL;
+     sharing_slots = NULL;
+     turn_syncs = NULL;
+     printer_threads = NULL;
+     printer_data = NULL;
+     pool_size = 0;
+     num_threads = 0;
+ }
+ 
+ /**
+  * adds up the spin hits, parks and yields of the first n printers
+  */
+ void sum_spin_stats(int n, unsigned long *hits, unsigned long *parks, unsigned long *yields) {
+     *hits = 0;
+     *parks = 0;
+     *yields = 0;
+     for (int i = 0; i < n; i++) {
+         *hits += printer_data[i].spin_hits;
+         *parks += printer_data[i].parks;
+         *yields += printer_data[i].yields;
+     }
+ }
+ 
+ /**
+  * returns how many printers take part in a run over the given document
+  * a thread without words would never pass the turn on, so only as many
+  * threads as there are turns take part in the ring
+  */
+ int ring_threads(const word_index_t *index) {
+     size_t turns = (index->count + chunk_size - 1) / chunk_size;
+     return ((size_t)num_threads > turns) ? (int)turns : num_threads;
+ }
+ 
+ /*
+  * positional output
+  * with -O pwrite or -O mmap the document is cut into one contiguous block
+  * of words per printer. every line's length is known up front, so a first
+  * job sums the bytes of each block, a prefix sum over the sums places the
+  * blocks in the file and a second job writes them, all at once and with
+  * no turns. the thread named on a line is still the one whose turn it
+  * would have been, so the bytes match normal mode.
+  */
+ 
+ /**
+  * returns the printed length of a word's line
+  */
+ static inline size_t line_length(int thread_id, size_t word_length) {
+     return printer_data[thread_id].prefix_length + word_length + 1;
+ }
+ 
+ /**
+  * stores formatted lines at their place in the output file
+  */
+ static inline void place_bytes(const char *buf, size_t length, off_t offset) {
+     if (output_map != NULL) {
+         memcpy(output_map + (offset - output_map_start), buf, length);
+     } else {
+         pwrite_all(STDOUT_FILENO, buf, length, offset);
+     }
+ }
+ 
+ /**
+  * first job: picks this printer's block and sums the length of its lines
+  */
+ void* measure_thread(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     const word_index_t *index = data->index;
+     
+     data->block_first = index->count * data->thread_id / data->ring_size;
+     data->block_last = index->count * (data->thread_id + 1) / data->ring_size;
+     
+     size_t bytes = 0;
+     for (size_t word_pos = data->block_first; word_pos < data->block_last; word_pos++) {
+         int owner = (int)((word_pos / data->chunk_size) % data->ring_size);
+         bytes += line_length(owner, index_word(index, word_pos)->length);
+     }
+     data->block_bytes = bytes;
+     
+     return NULL;
+ }
+ 
+ /**
+  * second job: formats this printer's block and writes it from block_offset
+  * on, an arena of output_block bytes at a time
+  */
+ void* place_thread(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     const word_index_t *index = data->index;
+     output_arena_t *arena = &data->out;
+     off_t offset = data->block_offset;
+     
+     track_cpu(data);
+     reserve_arena(arena, LINE_OVERHEAD);
+     
+     for (size_t word_pos = data->block_first; word_pos < data->block_last; word_pos++) {
+         // add random delay (10-100ms)
+         if (!benchmark_mode) {
+             usleep((rand() % 91 + 10) * 1000);
+         }
+         
+         const word_span_t *word = index_word(index, word_pos);
+         if (arena->length + word->length + LINE_OVERHEAD > arena->capacity) {
+             place_bytes(arena->data, arena->length, offset);
+             offset += arena->length;
+             reserve_arena(arena, word->length + LINE_OVERHEAD);
+         }
+         
+         int owner = (int)((word_pos / data->chunk_size) % data->ring_size);
+         arena->length += format_line(arena->data + arena->length, owner,
+                                      index->text + word->offset, word->length);
+     }
+     
+     place_bytes(arena->data, arena->length, offset);
+     arena->length = 0;
+     
+     return NULL;
+ }
+ 
+ /**
+  * prints a document into the file on stdout from its current offset on
+  */
+ void print_positional(const word_index_t *index, int active) {
+     print_job_t job;
+     job.run = measure_thread;
+     job.index = index;
+     job.mode = MODE_NORMAL;
+     job.chunk_size = chunk_size;
+     job.turns = active;
+     job.active = active;
+     start_job(&job);
+     finish_job();
+     
+     // exclusive prefix sum of the block sizes gives every block its offset
+     off_t base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+     if (base < 0) {
+         perror("lseek failed");
+         exit(EXIT_FAILURE);
+     }
+     off_t end = base;
+     for (int i = 0; i < active; i++) {
+         printer_data[i].block_offset = end;
+         end += (off_t)printer_data[i].block_bytes;
+     }
+     
+     // mmap: grow the file first, the mapping has to start on a page
+     size_t map_length = 0;
+     if (output_mode == OUTPUT_MMAP && end > base) {
+         if (ftruncate(STDOUT_FILENO, end) != 0) {
+             perror("ftruncate failed");
+             exit(EXIT_FAILURE);
+         }
+         output_map_start = base & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+         map_length = (size_t)(end - output_map_start);
+         void *map = mmap(NULL, map_length, PROT_WRITE, MAP_SHARED, STDOUT_FILENO, output_map_start);
+         if (map == MAP_FAILED) {
+             perror("mmap failed");
+             exit(EXIT_FAILURE);
+         }
+         output_map = (char *)map;
+     }
+     
+     job.run = place_thread;
+     start_job(&job);
+     finish_job();
+     
+     if (output_map != NULL) {
+         munmap(output_map, map_length);
+         output_map = NULL;
+     }
+     
+     // whatever is printed next goes after the document
+     if (lseek(STDOUT_FILENO, end, SEEK_SET) < 0) {
+         perror("lseek failed");
+         exit(EXIT_FAILURE);
+     }
+ }
+ 
+ /**
+  * prints a document with the pooled printers
+  * mode: MODE_NORMAL, MODE_CHAOS or MODE_REORDER
+  * returns the wall time of the run in nanoseconds
+  */
+ uint64_t print_paragraph(const word_index_t *index, int mode) {
+     thread_data_t *thread_data = printer_data;
+     int active = ring_threads(index);
+     
+     // whatever stdio still holds goes first
+     if (output_mode != OUTPUT_STDIO) {
+         fflush(stdout);
+     }
+     if (output_mode == OUTPUT_URING && uring.seekable) {
+         uring.offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+     }
+     
+     uint64_t start = now_ns();
+     
+     if (mode == MODE_REORDER) {
+         for (uint32_t k = 0; k < REORDER_SLOTS; k++) {
+             atomic_store(&reorder_slots[k].seq, k);
+             atomic_store(&reorder_slots[k].waiters, 0);
+         }
+     }
+     
+     // hand the document to the parked printers
+     int positional = (output_mode == OUTPUT_PWRITE || output_mode == OUTPUT_MMAP);
+     if (active > 0 && positional && mode != MODE_CHAOS) {
+         print_positional(index, active);
+     } else if (active > 0) {
+         print_job_t job;
+         job.run = print_thread;
+         job.index = index;
+         job.mode = mode;
+         job.chunk_size = chunk_size;
+         job.turns = (index->count + chunk_size - 1) / chunk_size;
+         job.active = active;
+         start_job(&job);
+         
+         // in reorder mode this thread is the emitter
+         if (mode == MODE_REORDER) {
+             reorder_drain(index);
+         }
+         
+         finish_job();
+     }
+     
+     // the segments of the last turns are still in the batch
+     if (out_batch.count > 0) {
+         flush_batch();
+     }
+     if (output_mode == OUTPUT_WRITER) {
+         writer_drain();
+     } else if (output_mode == OUTPUT_URING) {
+         uring_drain();
+     } else if (output_mode == OUTPUT_SPLICE) {
+         splice_flush();
+     }
+     
+     // flush first so the time includes getting the words out
+     fflush(stdout);
+     uint64_t elapsed = now_ns() - start;
+     
+     if (verbose && mode == MODE_NORMAL) {
+         unsigned long hits, parks, yields;
+         sum_spin_stats(active, &hits, &parks, &yields);
+         fprintf(stderr, "handoffs: %lu spin hits, %lu parks, %lu yields (spin limit %d)\n",
+                 hits, parks, yields, spin_limit);
+     }
+     
+     if (verbose) {
+         for (int i = 0; i < active; i++) {
+             fprintf(stderr, "thread %d: cpu %d%s, %lu migrations\n", i + 1,
+                     thread_data[i].last_cpu, thread_data[i].cpu >= 0 ? " (pinned)" : "",
+                     thread_data[i].migrations);
+         }
+     }
+     
+     return elapsed;
+ }
+ 
+ /**
+  * reports the throughput of one run on stderr
+  */
+ void report_run(const word_index_t *index, int mode, uint64_t elapsed) {
+     double seconds = (double)elapsed / 1e9;
+     fprintf(stderr, "%s: %zu words, %d threads, %zu words/turn, %.6f s, %.0f words/s, %.1f ns/word\n",
+             mode_names[mode], index->count, ring_threads(index), chunk_size, seconds,
+             seconds > 0 ? (double)index->count / seconds : 0.0,
+             index->count ? (double)elapsed / (double)index->count : 0.0);
+ }
+ 
+ /**
+  * thread function that passes the turn around without printing
+  */
+ void* handoff_thread(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     
+     for (size_t i = 0; i < data->turn_count; i++) {
+         size_t turn = data->first_turn + i * data->ring_size;
+         wait_turn(data, turn);
+         pass_turn(data, turn);
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * times the turn handoff of every sync backend, without printing or sleeping
+  */
+ void bench_handoff(const word_index_t *index) {
+     (void)index;
+     
+     // a handoff needs somebody to hand off to
+     if (pool_size < 2) {
+         free_printers();
+         alloc_printers(2);
+     }
+     int active = num_threads < 2 ? 2 : num_threads;
+     
+     printf("handoff benchmark: %d threads, %d handoffs, spin limit %d\n",
+            active, BENCH_HANDOFFS, spin_limit);
+     
+     int saved_backend = sync_backend;
+     for (int backend = 0; backend < SYNC_BACKEND_COUNT; backend++) {
+         sync_backend = backend;
+         
+         print_job_t job;
+         job.run = handoff_thread;
+         job.index = NULL;
+         job.mode = MODE_NORMAL;
+         job.chunk_size = 1;
+         job.turns = BENCH_HANDOFFS;
+         job.active = active;
+         
+         uint64_t start = now_ns();
+         start_job(&job);
+         finish_job();
+         uint64_t elapsed = now_ns() - start;
+         
+         unsigned long hits, parks, yields;
+         sum_spin_stats(active, &hits, &parks, &yields);
+         printf("  %-8s %10.1f ns/handoff %10lu spin hits %10lu parks %10lu yields\n", sync_ops[backend].name,
+                (double)elapsed / BENCH_HANDOFFS, hits, parks, yields);
+     }
+     sync_backend = saved_backend;
+ }
+ 
+ /**
+  * returns printer i's slot in the false sharing benchmark
+  */
+ static inline sharing_slot_t* sharing_slot(int i) {
+     return (sharing_slot_t*)(sharing_slots + (size_t)i * sharing_stride);
+ }
+ 
+ /**
+  * thread function of the false sharing benchmark
+  * a ring like handoff_thread, but on plain flags laid out by sharing_stride:
+  * packed, a waiter's counter sits on the line the previous thread writes
+  */
+ void* sharing_thread(void *arg) {
+     thread_data_t *data = (thread_data_t *)arg;
+     sharing_slot_t *own = sharing_slot(data->thread_id);
+     sharing_slot_t *next = sharing_slot((data->thread_id + 1) % data->ring_size);
+     
+     for (size_t i = 0; i < data->turn_count; i++) {
+         size_t turn = data->first_turn + i * data->ring_size;
+         int spins = 0;
+         while (atomic_load_explicit(&own->turn, memory_order_acquire) != (uint32_t)turn) {
+             own->spins++;
+             if (++spins < spin_limit) {
+                 cpu_relax();
+             } else {
+                 sched_yield();
+             }
+         }
+         atomic_store_explicit(&next->turn, (uint32_t)(turn + 1), memory_order_release);
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * times a flag ring with the flags packed together and then one per line,
+  * then the turn handoff over packed and padded sync objects
+  */
+ void bench_sharing(const word_index_t *index) {
+     (void)index;
+     
+     if (pool_size < 2) {
+         free_printers();
+         alloc_printers(2);
+     }
+     int active = num_threads < 2 ? 2 : num_threads;
+     
+     printf("false sharing benchmark: %d threads, %d handoffs, %d byte lines\n",
+            active, BENCH_HANDOFFS, CACHE_LINE_SIZE);
+     
+     const size_t strides[] = {sizeof(sharing_slot_t), CACHE_LINE_SIZE};
+     const char *layouts[] = {"packed", "padded"};
+     for (int l = 0; l < 2; l++) {
+         sharing_stride = strides[l];
+         memset(sharing_slots, 0, (size_t)pool_size * CACHE_LINE_SIZE);
+         
+         print_job_t job;
+         job.run = sharing_thread;
+         job.index = NULL;
+         job.mode = MODE_NORMAL;
+         job.chunk_size = 1;
+         job.turns = BENCH_HANDOFFS;
+         job.active = active;
+         
+         uint64_t start = now_ns();
+         start_job(&job);
+         finish_job();
+         uint64_t elapsed = now_ns() - start;
+         
+         printf("  %-8s %10.1f ns/handoff (%zu byte stride)\n", layouts[l],
+                (double)elapsed / BENCH_HANDOFFS, sharing_stride);
+     }
+     
+     // the real thing: handoff_thread over the printers' sync objects packed
+     // back to back with the turn counter right behind them, then as the
+     // printers use them, padded with the counter on a line of its own
+     double results[SYNC_BACKEND_COUNT][2];
+     int saved_backend = sync_backend;
+     const size_t sync_strides[] = {sizeof(turn_sync_t), TURN_SYNC_PADDED};
+     for (int l = 0; l < 2; l++) {
+         destroy_turn_syncs();
+         init_turn_syncs(sync_strides[l]);
+         turn_counter = (l == 0) ? (atomic_size_t *)turn_sync(pool_size) : &next_turn.value;
+         
+         for (int backend = 0; backend < SYNC_BACKEND_COUNT; backend++) {
+             sync_backend = backend;
+             
+             print_job_t job;
+             job.run = handoff_thread;
+             job.index = NULL;
+             job.mode = MODE_NORMAL;
+             job.chunk_size = 1;
+             job.turns = BENCH_HANDOFFS;
+             job.active = active;
+             
+             uint64_t start = now_ns();
+             start_job(&job);
+             finish_job();
+             results[backend][l] = (double)(now_ns() - start) / BENCH_HANDOFFS;
+         }
+     }
+     sync_backend = saved_backend;
+     
+     printf("turn handoff, ns/handoff with the sync objects %zu and %zu bytes apart:\n",
+            sync_strides[0], sync_strides[1]);
+     for (int backend = 0; backend < SYNC_BACKEND_COUNT; backend++) {
+         printf("  %-8s %10.1f packed %10.1f padded\n", sync_ops[backend].name,
+                results[backend][0], results[backend][1]);
+     }
+ }
+ 
+ /**
+  * prints every document in normal (or reorder) mode, then in chaos mode
+  */
+ void print_documents(word_index_t **indexes, size_t ndocs, int ordered_mode) {
+     // print in normal mode, naming what keeps the words in order
+     if (ordered_mode == MODE_REORDER) {
+         printf("\n=== Normal Mode (%s buffer) ===\n", mode_names[ordered_mode]);
+     } else if (output_mode == OUTPUT_PWRITE || output_mode == OUTPUT_MMAP) {
+         printf("\n=== Normal Mode (%s at fixed offsets) ===\n", output_names[output_mode]);
+     } else {
+         printf("\n=== Normal Mode (%s turns) ===\n", sync_ops[sync_backend].name);
+     }
+     for (size_t d = 0; d < ndocs; d++) {
+         uint64_t elapsed = print_paragraph(indexes[d], ordered_mode);
+         if (benchmark_mode) {
+             report_run(indexes[d], ordered_mode, elapsed);
+         }
+     }
+     
+     // wait a moment to visually separate the outputs
+     if (!benchmark_mode) {
+         sleep(1);
+     }
+     
+     // print in chaos mode
+     printf("\n=== Chaos Mode (Without Semaphore Synchronization) ===\n");
+     for (size_t d = 0; d < ndocs; d++) {
+         uint64_t elapsed = print_paragraph(indexes[d], MODE_CHAOS);
+         if (benchmark_mode) {
+             report_run(indexes[d], MODE_CHAOS, elapsed);
+         }
+     }
+ }
+ 
+ /**
+  * steps through powers of two up to max, ending on max itself
+  */
+ static inline int next_thread_count(int t, int max) {
+     return (t < max && t * 2 > max) ? max : t * 2;
+ }
+ 
+ /**
+  * formats every line of the document twice, with snprintf and with
+  * format_line, checks that the bytes match and compares ns/line
+  * lines are attributed to threads as in normal mode with one word per turn
+  */
+ void bench_format(const word_index_t *index) {
+     int threads = num_threads;
+     size_t bound = lines_bound(index, 0, index->count) + 1;
+     char *expected = (char*)malloc(bound);
+     char *actual = (char*)malloc(bound);
+     if (expected == NULL || actual == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     
+     uint64_t start = now_ns();
+     size_t expected_length = 0;
+     for (size_t word_pos = 0; word_pos < index->count; word_pos++) {
+         const word_span_t *word = index_word(index, word_pos);
+         expected_length += (size_t)snprintf(expected + expected_length, bound - expected_length,
+                                             "Thread %d: %.*s\n", (int)(word_pos % threads) + 1,
+                                             (int)word->length, index->text + word->offset);
+     }
+     uint64_t printf_ns = now_ns() - start;
+     
+     start = now_ns();
+     size_t actual_length = 0;
+     for (size_t word_pos = 0; word_pos < index->count; word_pos++) {
+         const word_span_t *word = index_word(index, word_pos);
+         actual_length += format_line(actual + actual_length, (int)(word_pos % threads),
+                                      index->text + word->offset, word->length);
+     }
+     uint64_t format_ns = now_ns() - start;
+     
+     int identical = (actual_length == expected_length && memcmp(actual, expected, actual_length) == 0);
+     double lines = index->count ? (double)index->count : 1.0;
+     printf("format benchmark: %zu lines, %d threads, %zu bytes, output %s\n",
+            index->count, threads, actual_length, identical ? "identical" : "DIFFERS");
+     printf("  %-8s %10.1f ns/line\n", "snprintf", (double)printf_ns / lines);
+     printf("  %-8s %10.1f ns/line\n", "memcpy", (double)format_ns / lines);
+     
+     free(expected);
+     free(actual);
+ }
+ 
+ /**
+  * sweeps the words per turn against the thread count in normal mode
+  * the words go to stdout as usual, the table of ns/word to stderr
+  */
+ void bench_chunk(const word_index_t *index) {
+     static const size_t chunk_sizes[] = {1, 2, 4, 8, 16, 32, 64, 128};
+     int max_threads = num_threads;
+     size_t saved_chunk = chunk_size;
+     int saved_benchmark = benchmark_mode;
+     benchmark_mode = 1;
+     
+     fprintf(stderr, "chunk benchmark: %zu words, ns/word by words per turn (rows) and threads (columns)\n",
+             index->count);
+     fprintf(stderr, "%8s", "k");
+     for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads)) {
+         fprintf(stderr, " %9d", t);
+     }
+     fprintf(stderr, "\n");
+     
+     for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+         chunk_size = chunk_sizes[c];
+         fprintf(stderr, "%8zu", chunk_size);
+         for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads)) {
+             num_threads = t;
+             uint64_t elapsed = print_paragraph(index, MODE_NORMAL);
+             fprintf(stderr, " %9.1f", index->count ? (double)elapsed / (double)index->count : 0.0);
+         }
+         fprintf(stderr, "\n");
+     }
+     
+     num_threads = max_threads;
+     chunk_size = saved_chunk;
+     benchmark_mode = saved_benchmark;
+ }
+ 
+ // benchmarks selected with -B
+ typedef struct {
+     const char *name;
+     void (*run)(const word_index_t *index);
+ } benchmark_t;
+ 
+ const benchmark_t benchmarks[] = {
+     {"handoff", bench_handoff},
+     {"chunk", bench_chunk},
+     {"format", bench_format},
+     {"sharing", bench_sharing},
+ };
+ 
+ /**
+  * prints the command line usage
+  */
+ void usage(const char *prog) {
+     fprintf(stderr, "usage: %s [options] [file | - ...]\n", prog);
+     fprintf(stderr, "  -d s  characters that separate words (default: whitespace)\n");
+     fprintf(stderr, "  -j n  tokenize with n threads (default: one per cpu)\n");
+     fprintf(stderr, "  -i    intern words, storing each distinct word once\n");
+     fprintf(stderr, "  -t n  print with n threads (default: one per cpu)\n");
+     fprintf(stderr, "  -s b  turn handoff backend: sem (default), condvar, eventfd, futex or spin\n");
+     fprintf(stderr, "  -p n  spin at most n pauses before parking (default: %d, 0 on one cpu)\n",
+             DEFAULT_SPIN_LIMIT);
+     fprintf(stderr, "  -v    report handoff spin hits, parks, yields and thread migrations on stderr\n");
+     fprintf(stderr, "  -b    benchmark: no delays, report throughput on stderr\n");
+     fprintf(stderr, "  -R    order normal mode through a reorder buffer instead of turns\n");
+     fprintf(stderr, "  -k n  print n consecutive words per turn (default: 1)\n");
+     fprintf(stderr, "  -O o  output: stdio (a line per word through stdout, default), writev (buffered per thread),\n");
+     fprintf(stderr, "        pwrite or mmap (each thread places its block of a regular file, no turns),\n");
+     fprintf(stderr, "        writer (double buffered blocks written by a thread of their own),\n");
+     fprintf(stderr, "        uring (like writev, queued to io_uring so printers do not wait for writes),\n");
+     fprintf(stderr, "        splice (a pipe only: page-aligned blocks gifted to it with vmsplice)\n");
+     fprintf(stderr, "  -z n  write n bytes at a time to a pipe or file (default: %d, %d with -O writer)\n",
+             DEFAULT_OUTPUT_BLOCK, WRITER_BLOCK);
+     fprintf(stderr, "  -o f  write to file f instead of stdout\n");
+     fprintf(stderr, "  -c l  pin printer i to the i-th cpu of a list such as 0-3,8\n");
+     fprintf(stderr, "  -T    order the ring by cpu topology, pinning to -c or all online cpus\n");
+     fprintf(stderr, "  -B b  run a benchmark on the first document instead of printing:\n");
+     fprintf(stderr, "        handoff (turn handoff per backend), chunk (words per turn x threads),\n");
+     fprintf(stderr, "        sharing (flag ring packed vs padded to a cache line),\n");
+     fprintf(stderr, "        format (snprintf vs precomputed prefixes per line)\n");
+     fprintf(stderr, "  file  document to print, mapped read-only; may be repeated\n");
+     fprintf(stderr, "  -     read the document from stdin\n");
+     fprintf(stderr, "without a file the built-in paragraph is printed\n");
+ }
+ 
+ int main(int argc, char *argv[]) {
+     const char *delimiters = DEFAULT_DELIMITERS;
+     int tokenizer_threads = 0;
+     int intern = 0;
+     int printer_count = 0;
+     const char *bench = NULL;
+     const char *output_path = NULL;
+     int block_given = 0;
+     int ordered_mode = MODE_NORMAL;
+     int topology_order = 0;
+     int opt;
+     while ((opt = getopt(argc, argv, "hd:j:it:s:p:vbRk:c:TB:O:z:o:")) != -1) {
+         switch (opt) {
+         case 'h':
+             usage(argv[0]);
+             return 0;
+         case 'd':
+             delimiters = optarg;
+             break;
+         case 'j':
+             tokenizer_threads = atoi(optarg);
+             break;
+         case 'i':
+             intern = 1;
+             break;
+         case 't':
+             printer_count = atoi(optarg);
+             if (printer_count < 1) {
+                 fprintf(stderr, "%s: thread count must be at least 1\n", argv[0]);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 's':
+             sync_backend = -1;
+             for (int b = 0; b < SYNC_BACKEND_COUNT; b++) {
+                 if (strcmp(optarg, sync_ops[b].name) == 0) {
+                     sync_backend = b;
+                 }
+             }
+             if (sync_backend < 0) {
+                 fprintf(stderr, "%s: unknown sync backend '%s'\n", argv[0], optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'p':
+             spin_limit = atoi(optarg);
+             if (spin_limit < 0) {
+                 spin_limit = 0;
+             }
+             break;
+         case 'v':
+             verbose = 1;
+             break;
+         case 'b':
+             benchmark_mode = 1;
+             break;
+         case 'R':
+             ordered_mode = MODE_REORDER;
+             break;
+         case 'k':
+             if (atol(optarg) < 1) {
+                 fprintf(stderr, "%s: words per turn must be at least 1\n", argv[0]);
+                 return EXIT_FAILURE;
+             }
+             chunk_size = (size_t)atol(optarg);
+             break;
+         case 'O':
+             output_mode = -1;
+             for (int o = 0; o < OUTPUT_MODE_COUNT; o++) {
+                 if (strcmp(optarg, output_names[o]) == 0) {
+                     output_mode = o;
+                 }
+             }
+             if (output_mode < 0) {
+                 fprintf(stderr, "%s: unknown output mode '%s'\n", argv[0], optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'z':
+             if (atol(optarg) < 0) {
+                 fprintf(stderr, "%s: block size must not be negative\n", argv[0]);
+                 return EXIT_FAILURE;
+             }
+             output_block = (size_t)atol(optarg);
+             block_given = 1;
+             break;
+         case 'o':
+             output_path = optarg;
+             break;
+         case 'c':
+             free(pin_cpus);
+             pin_cpu_count = parse_cpu_list(optarg, &pin_cpus);
+             if (pin_cpu_count < 0) {
+                 fprintf(stderr, "%s: bad cpu list '%s'\n", argv[0], optarg);
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 'T':
+             topology_order = 1;
+             break;
+         case 'B':
+             bench = optarg;
+             break;
+         default:
+             usage(argv[0]);
+             return EXIT_FAILURE;
+         }
+     }
+     
+     // one printer per online cpu unless told otherwise
+     long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+     if (printer_count == 0) {
+         printer_count = (cpus > 0) ? (int)cpus : 1;
+     }
+     
+     // spinning only pays when the thread passing the turn runs elsewhere
+     if (spin_limit < 0) {
+         spin_limit = (cpus > 1) ? DEFAULT_SPIN_LIMIT : 0;
+     }
+     
+     // stdout becomes the file, opened read-write so -O mmap can map it
+     if (output_path != NULL) {
+         int fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+         if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+             perror(output_path);
+             return EXIT_FAILURE;
+         }
+         close(fd);
+     }
+     
+     // positional output places lines by offset, which needs a regular file
+     if (output_mode == OUTPUT_PWRITE || output_mode == OUTPUT_MMAP) {
+         struct stat st;
+         int flags = fcntl(STDOUT_FILENO, F_GETFL);
+         if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode) || flags < 0 || (flags & O_APPEND)) {
+             fprintf(stderr, "%s: %s output needs a regular file opened without append, using writev\n",
+                     argv[0], output_names[output_mode]);
+             output_mode = OUTPUT_WRITEV;
+         } else if (output_mode == OUTPUT_MMAP && (flags & O_ACCMODE) != O_RDWR) {
+             fprintf(stderr, "%s: mmap output needs a file opened read-write (-o), using pwrite\n", argv[0]);
+             output_mode = OUTPUT_PWRITE;
+         }
+     }
+     
+     // a terminal sees every turn as soon as it is printed
+     if (isatty(STDOUT_FILENO)) {
+         output_block = 0;
+     } else if (!block_given && output_mode == OUTPUT_WRITER) {
+         output_block = WRITER_BLOCK;
+     }
+     if (output_mode == OUTPUT_WRITER) {
+         start_writer();
+     }
+     if (output_mode == OUTPUT_SPLICE && splice_setup() != 0) {
+         fprintf(stderr, "%s: splice output needs stdout to be a pipe, using writev\n", argv[0]);
+         output_mode = OUTPUT_WRITEV;
+     }
+     if (output_mode == OUTPUT_URING && uring_setup() != 0) {
+         fprintf(stderr, "%s: io_uring unavailable (%s), using writev\n", argv[0], strerror(errno));
+         output_mode = OUTPUT_WRITEV;
+     }
+     
+     // the padding is fixed at build time, say so when it falls short
+     long line_size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+     if (line_size > CACHE_LINE_SIZE) {
+         fprintf(stderr, "%s: cache lines are %ld bytes, build with -DCACHE_LINE_SIZE=%ld\n",
+                 argv[0], line_size, line_size);
+     }
+     
+     // consecutive turns run on cpus that share the most cache
+     if (topology_order) {
+         if (pin_cpu_count == 0) {
+             pin_cpu_count = online_cpu_list(&pin_cpus);
+             if (pin_cpu_count < 0) {
+                 fprintf(stderr, "%s: cannot read the online cpus\n", argv[0]);
+                 return EXIT_FAILURE;
+             }
+         }
+         order_cpus_by_topology(pin_cpus, pin_cpu_count);
+     }
+     
+     // the printers start once and park between runs
+     alloc_printers(printer_count);
+     
+     const benchmark_t *benchmark = NULL;
+     if (bench != NULL) {
+         for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+             if (strcmp(bench, benchmarks[b].name) == 0) {
+                 benchmark = &benchmarks[b];
+             }
+         }
+         if (benchmark == NULL) {
+             fprintf(stderr, "%s: unknown benchmark '%s'\n", argv[0], bench);
+             return EXIT_FAILURE;
+         }
+     }
+     
+     // seed the random number generator
+     srand(time(NULL));
+     
+     // open the documents and split them into words without copying them
+     size_t ndocs = (optind < argc) ? (size_t)(argc - optind) : 1;
+     input_t *inputs = (input_t*)malloc(ndocs * sizeof(input_t));
+     if (inputs == NULL) {
+         perror("malloc failed");
+         exit(EXIT_FAILURE);
+     }
+     for (size_t d = 0; d < ndocs; d++) {
+         open_input(optind < argc ? argv[optind + d] : NULL, &inputs[d]);
+     }
+     
+     tokenizer_config_t config;
+     init_delimiters(&config.delims, delimiters);
+     config.threads = tokenizer_threads;
+     config.intern = intern;
+     word_index_t **indexes = tokenize_documents(inputs, ndocs, &config);
+     
+     if (benchmark != NULL) {
+         benchmark->run(indexes[0]);
+     } else {
+         print_documents(indexes, ndocs, ordered_mode);
+     }
+     
+     // cleanup
+     if (output_mode == OUTPUT_WRITER) {
+         stop_writer();
+         if (verbose) {
+             fprintf(stderr, "writer: %lu writes\n", writer.writes);
+         }
+     }
+     if (output_mode == OUTPUT_URING) {
+         uring_close();
+     }
+     if (output_mode == OUTPUT_SPLICE) {
+         munmap(gift.block, gift.capacity);
+         if (verbose) {
+             fprintf(stderr, "splice: %lu blocks gifted\n", gift.gifts);
+         }
+     }
+     free_printers();
+     free(pin_cpus);
+     for (size_t d = 0; d < ndocs; d++) {
+         free_word_index(indexes[d]);
+         close_input(&inputs[d]);
+     }
+     free(indexes);
+     free(inputs);
      
      return 0;
  }
\ No newline at end of file